@@ -0,0 +1,94 @@
+/*
+ * bench-cache.c - cost of a proxy cache lookup as the cache fills up
+ *
+ * Fills the cache with small objects in steps and, at each step, times
+ * hits on random cached uris and misses on uris that were never cached.
+ * The "scan" column is the strcmp walk over every key that lookups used
+ * to do, measured on the same keys for comparison.
+ *
+ * usage: ./bench-cache [lookups per step]
+ */
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_OBJECTS 16384
+#define OBJECT_SIZE 32 // small enough for MAX_OBJECTS to fit in the cache
+#define KEY_LEN 64
+
+static char keys[MAX_OBJECTS][KEY_LEN];
+static char misses[MAX_OBJECTS][KEY_LEN];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * the lookup before the index: walk the list comparing every key
+ */
+static int scan_keys(int nobjs, const char *key) {
+    for (int i = nobjs - 1; i >= 0; i--) {
+        if (strcmp(keys[i], key) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    long lookups = argc > 1 ? strtol(argv[1], NULL, 10) : 200000;
+    char body[OBJECT_SIZE];
+    volatile long sink = 0;
+
+    memset(body, 'x', sizeof(body));
+    init_cache(1);
+    srand(213);
+
+    printf("%8s %12s %12s %12s\n", "objects", "hit ns", "miss ns",
+           "scan ns");
+
+    int nobjs = 0;
+    for (int step = 16; step <= MAX_OBJECTS; step *= 4) {
+        for (; nobjs < step; nobjs++) {
+            snprintf(keys[nobjs], KEY_LEN,
+                     "http://localhost:15213/files/object-%06d.html", nobjs);
+            snprintf(misses[nobjs], KEY_LEN,
+                     "http://localhost:15213/files/missing-%06d.html", nobjs);
+            cache_fill_t fill;
+            cache_fill_init(&fill);
+            cache_fill_append(&fill, body, sizeof(body));
+            insert_cache_obj_to_cache(keys[nobjs], &fill);
+        }
+
+        double start = now_ns();
+        for (long i = 0; i < lookups; i++) {
+            cache_obj_t *obj = search_cache_obj(keys[rand() % nobjs]);
+            sink += obj != NULL;
+            free_cache_obj(obj);
+        }
+        double hit = (now_ns() - start) / lookups;
+
+        start = now_ns();
+        for (long i = 0; i < lookups; i++) {
+            sink += search_cache_obj(misses[rand() % nobjs]) != NULL;
+        }
+        double miss_ns = (now_ns() - start) / lookups;
+
+        // fewer rounds: the scan is what gets slow
+        long scans = lookups / 10;
+        start = now_ns();
+        for (long i = 0; i < scans; i++) {
+            sink += scan_keys(nobjs, keys[rand() % nobjs]);
+        }
+        double scan = (now_ns() - start) / scans;
+
+        printf("%8d %12.1f %12.1f %12.1f\n", nobjs, hit, miss_ns, scan);
+    }
+
+    return sink < 0;
+}
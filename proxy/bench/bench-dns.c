@@ -0,0 +1,111 @@
+/*
+ * bench-dns.c - name lookups per second with and without the dns cache
+ *
+ * Threads keep resolving names from the list given, which should be ones
+ * /etc/hosts answers so no DNS server is involved, plus one name that
+ * does not resolve, first through getaddrinfo() itself and then through
+ * dns_resolve(). All threads start at once on a cold cache, so the first
+ * lookup of every name is shared by whoever misses on it meanwhile. The
+ * cache's counters are printed at the end.
+ *
+ * usage: ./bench-dns [threads] [names...]
+ */
+#include "dns.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUN_MS 500
+#define MAX_THREADS 64
+
+static const char *default_names[] = {"localhost"};
+static const char **names;
+static int nnames;
+static volatile int stop;
+
+typedef struct {
+    pthread_t tid;
+    int (*resolve)(const char *, const char *);
+    long lookups;
+} worker_t;
+
+static int resolve_direct(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *listp;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    int rc = getaddrinfo(host, port, &hints, &listp);
+    if (rc == 0) {
+        freeaddrinfo(listp);
+    }
+    return rc;
+}
+
+static int resolve_cached(const char *host, const char *port) {
+    dns_result_t res;
+    return dns_resolve(host, port, &res);
+}
+
+static void *worker(void *vargp) {
+    worker_t *w = vargp;
+    long lookups = 0;
+    // the names in turn, then the one that fails
+    for (int i = 0; !stop; i = (i + 1) % (nnames + 1)) {
+        const char *host = i < nnames ? names[i] : "no-such-host.invalid";
+        w->resolve(host, "80");
+        lookups++;
+    }
+    w->lookups = lookups;
+    return NULL;
+}
+
+static void run(const char *name, int (*resolve)(const char *, const char *),
+                int nthreads) {
+    worker_t workers[MAX_THREADS];
+    struct timespec pause = {RUN_MS / 1000, (RUN_MS % 1000) * 1000000L};
+
+    stop = 0;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].resolve = resolve;
+        pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+    }
+    nanosleep(&pause, NULL);
+    stop = 1;
+
+    long lookups = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        lookups += workers[i].lookups;
+    }
+    printf("%12s %8d %14.0f\n", name, nthreads,
+           (double)lookups * 1000 / RUN_MS);
+}
+
+int main(int argc, char **argv) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    if (nthreads < 1 || nthreads > MAX_THREADS) {
+        nthreads = 4;
+    }
+    names = default_names;
+    nnames = 1;
+    if (argc > 2) {
+        names = (const char **)argv + 2;
+        nnames = argc - 2;
+    }
+
+    printf("%12s %8s %14s\n", "resolver", "threads", "lookups/s");
+    run("getaddrinfo", resolve_direct, nthreads);
+    run("dns cache", resolve_cached, nthreads);
+
+    dns_stats_t stats;
+    dns_stats(&stats);
+    printf("hits %zu (negative %zu, coalesced %zu), misses %zu\n", stats.hits,
+           stats.negative, stats.coalesced, stats.misses);
+    return 0;
+}
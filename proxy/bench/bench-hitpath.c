@@ -0,0 +1,132 @@
+/*
+ * bench-hitpath.c - cost of writing a cache hit to the client
+ *
+ * A cached object is written to a unix socket drained by another thread,
+ * once in MAXLINE pieces as serve() used to, and once through
+ * cache_obj_write() which hands the kernel all remaining segments of the
+ * object per call. Reports write syscalls per object and bytes per second.
+ *
+ * usage: ./bench-hitpath [MB per run]
+ */
+#include "cache.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const size_t sizes[] = {1024, 16 * 1024, MAX_OBJECT_SIZE};
+
+static void *drain(void *vargp) {
+    int fd = *(int *)vargp;
+    char buf[64 * 1024];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* the old hit path: every piece is a separate rio_writen */
+static long send_chunked(int fd, cache_obj_t *obj) {
+    long calls = 0;
+    for (cache_segment_t *seg = obj->body; seg; seg = seg->next) {
+        size_t off = 0;
+        while (off < seg->len) {
+            size_t len = seg->len - off;
+            if (len > MAXLINE) {
+                len = MAXLINE;
+            }
+            ssize_t n = write(fd, seg->data + off, len);
+            calls++;
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("write");
+                exit(1);
+            }
+            off += (size_t)n;
+        }
+    }
+    return calls;
+}
+
+static long send_whole(int fd, cache_obj_t *obj) {
+    long calls = 0;
+    size_t off = 0;
+    while (off < obj->size) {
+        ssize_t n = cache_obj_write(fd, obj, off);
+        calls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cache_obj_write");
+            exit(1);
+        }
+        off += (size_t)n;
+    }
+    return calls;
+}
+
+static void run(const char *name, long (*send)(int, cache_obj_t *),
+                const char *key, size_t size, long objects) {
+    int sv[2];
+    pthread_t tid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    pthread_create(&tid, NULL, drain, &sv[1]);
+
+    long calls = 0;
+    double start = now_sec();
+    for (long i = 0; i < objects; i++) {
+        cache_obj_t *obj = search_cache_obj(key);
+        calls += send(sv[0], obj);
+        free_cache_obj(obj);
+    }
+    double elapsed = now_sec() - start;
+
+    close(sv[0]);
+    pthread_join(tid, NULL);
+    close(sv[1]);
+
+    printf("%8zu %10s %14.2f %10.1f\n", size, name,
+           (double)calls / (double)objects,
+           (double)size * (double)objects / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    long mb = argc > 1 ? strtol(argv[1], NULL, 10) : 256;
+    char *body = malloc(MAX_OBJECT_SIZE);
+
+    memset(body, 'x', MAX_OBJECT_SIZE);
+    init_cache(1);
+
+    printf("%8s %10s %14s %10s\n", "size", "path", "syscalls/hit", "MB/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char key[64];
+        long objects = mb * 1024 * 1024 / (long)sizes[i];
+        snprintf(key, sizeof(key), "http://localhost/object-%zu", sizes[i]);
+        cache_fill_t fill;
+        cache_fill_init(&fill);
+        cache_fill_append(&fill, body, sizes[i]);
+        insert_cache_obj_to_cache(key, &fill);
+        run("chunked", send_chunked, key, sizes[i], objects);
+        run("whole", send_whole, key, sizes[i], objects);
+    }
+    free(body);
+    return 0;
+}
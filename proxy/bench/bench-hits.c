@@ -0,0 +1,88 @@
+/*
+ * bench-hits.c - throughput of concurrent cache hits
+ *
+ * Every thread keeps looking up random uris from a small, fully cached
+ * working set, which is the read-heavy case: lookups should scale with
+ * the number of threads since hits take no lock.
+ *
+ * usage: ./bench-hits [max threads] [shards]
+ */
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OBJECTS 64
+#define OBJECT_SIZE 1024
+#define KEY_LEN 64
+#define RUN_MS 500
+
+static char keys[OBJECTS][KEY_LEN];
+static volatile int stop;
+
+typedef struct {
+    pthread_t tid;
+    unsigned int seed;
+    long hits;
+} worker_t;
+
+static void *worker(void *vargp) {
+    worker_t *w = vargp;
+    long hits = 0;
+    while (!stop) {
+        cache_obj_t *obj = search_cache_obj(keys[rand_r(&w->seed) % OBJECTS]);
+        hits += obj != NULL;
+        free_cache_obj(obj);
+    }
+    w->hits = hits;
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    long max_threads =
+        argc > 1 ? strtol(argv[1], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    int shards = argc > 2 ? (int)strtol(argv[2], NULL, 10) : 1;
+    char body[OBJECT_SIZE];
+
+    memset(body, 'x', sizeof(body));
+    init_cache(shards);
+    for (int i = 0; i < OBJECTS; i++) {
+        snprintf(keys[i], KEY_LEN,
+                 "http://localhost:15213/files/object-%06d.html", i);
+        cache_fill_t fill;
+        cache_fill_init(&fill);
+        cache_fill_append(&fill, body, sizeof(body));
+        insert_cache_obj_to_cache(keys[i], &fill);
+    }
+
+    worker_t *workers = calloc((size_t)max_threads, sizeof(worker_t));
+    printf("%8s %14s %14s\n", "threads", "Mhits/s", "Mhits/s/thread");
+    for (long n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+        stop = 0;
+        for (long i = 0; i < n; i++) {
+            workers[i].seed = (unsigned int)i + 1;
+            pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+        }
+        struct timespec run = {RUN_MS / 1000, (RUN_MS % 1000) * 1000000L};
+        nanosleep(&run, NULL);
+        stop = 1;
+
+        long total = 0;
+        for (long i = 0; i < n; i++) {
+            pthread_join(workers[i].tid, NULL);
+            total += workers[i].hits;
+        }
+        double rate = total / (RUN_MS * 1e3);
+        printf("%8ld %14.2f %14.2f\n", n, rate, rate / n);
+        if (n == max_threads) {
+            break;
+        }
+    }
+
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * bench-load.c - requests per second a running proxy serves
+ *
+ * Client threads keep asking the proxy on localhost:port for uri, each on
+ * a connection of its own that it reads to the end, for a few seconds.
+ * Start the proxy with the engine to measure, e.g. "./proxy -m epoll 15213"
+ * and then "./proxy -m uring 15213", and point uri at an end server: the
+ * first request caches it, so a cachable uri measures the hit path and an
+ * uncachable one the relay. Requests that fail or get no bytes back are
+ * counted as errors.
+ *
+ * usage: ./bench-load <port> <uri> [clients] [seconds]
+ */
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 256
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_SECONDS 5
+#define BUF_SIZE (64 * 1024)
+
+static struct addrinfo *proxy_addr;
+static char request[4096];
+static size_t request_len;
+static volatile int stop;
+
+typedef struct {
+    pthread_t tid;
+    long requests;
+    long errors;
+    long long bytes;
+    long long latency_ns;
+} client_t;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * send the request on a new connection and read the response to the end
+ * return the bytes received, or -1 on failure
+ */
+static long long fetch(char *buf) {
+    int fd = socket(proxy_addr->ai_family, proxy_addr->ai_socktype,
+                    proxy_addr->ai_protocol);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) != 0 ||
+        send(fd, request, request_len, MSG_NOSIGNAL) != (ssize_t)request_len) {
+        close(fd);
+        return -1;
+    }
+    long long total = 0;
+    ssize_t n;
+    while ((n = recv(fd, buf, BUF_SIZE, 0)) > 0) {
+        total += n;
+    }
+    close(fd);
+    return n < 0 ? -1 : total;
+}
+
+static void *client(void *vargp) {
+    client_t *c = vargp;
+    char *buf = malloc(BUF_SIZE);
+    if (!buf) {
+        return NULL;
+    }
+    while (!stop) {
+        long long start = now_ns();
+        long long n = fetch(buf);
+        if (n <= 0) {
+            c->errors++;
+            continue;
+        }
+        c->latency_ns += now_ns() - start;
+        c->requests++;
+        c->bytes += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <port> <uri> [clients] [seconds]\n",
+                argv[0]);
+        return 1;
+    }
+    int nclients = argc > 3 ? atoi(argv[3]) : DEFAULT_CLIENTS;
+    int seconds = argc > 4 ? atoi(argv[4]) : DEFAULT_SECONDS;
+    if (nclients < 1 || nclients > MAX_CLIENTS || seconds < 1) {
+        fprintf(stderr, "clients must be 1 to %d, seconds at least 1\n",
+                MAX_CLIENTS);
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo("localhost", argv[1], &hints, &proxy_addr);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return 1;
+    }
+    request_len = (size_t)snprintf(request, sizeof(request),
+                                   "GET %s HTTP/1.0\r\n\r\n", argv[2]);
+    if (request_len >= sizeof(request)) {
+        fprintf(stderr, "uri too long\n");
+        return 1;
+    }
+
+    // warm the cache up, so that every client measures the same path
+    char *buf = malloc(BUF_SIZE);
+    if (!buf || fetch(buf) <= 0) {
+        fprintf(stderr, "no response from the proxy at port %s\n", argv[1]);
+        return 1;
+    }
+    free(buf);
+
+    client_t *clients = calloc((size_t)nclients, sizeof(client_t));
+    if (!clients) {
+        perror("calloc");
+        return 1;
+    }
+    long long start = now_ns();
+    for (int i = 0; i < nclients; i++) {
+        pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+    }
+    sleep((unsigned)seconds);
+    stop = 1;
+
+    long requests = 0;
+    long errors = 0;
+    long long bytes = 0;
+    long long latency_ns = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(clients[i].tid, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        latency_ns += clients[i].latency_ns;
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+
+    printf("%-10s %12s %10s %12s %8s\n", "clients", "requests/s", "MB/s",
+           "latency us", "errors");
+    printf("%-10d %12.0f %10.1f %12.1f %8ld\n", nclients,
+           (double)requests / elapsed, (double)bytes / elapsed / 1e6,
+           requests ? (double)latency_ns / (double)requests / 1e3 : 0.0,
+           errors);
+    freeaddrinfo(proxy_addr);
+    free(clients);
+    return 0;
+}
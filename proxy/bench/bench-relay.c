@@ -0,0 +1,284 @@
+/*
+ * bench-relay.c - throughput of relaying large responses through a proxy
+ *
+ * Starts a local origin serving one response of the given size from
+ * memory, too big for the cache, and has client threads fetch it through
+ * the running proxy on localhost:port over and over for a few seconds.
+ * Given the proxy's pid, it also reports the user and system CPU time the
+ * proxy spent per gigabyte relayed, from /proc: the thread and pool
+ * engines splice such responses, so their user time stays near zero,
+ * while the epoll engine copies every byte through its buffer.
+ *
+ * usage: ./bench-relay <port> [megabytes] [clients] [seconds] [proxy pid]
+ */
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MB 8
+#define DEFAULT_CLIENTS 2
+#define DEFAULT_SECONDS 5
+#define MAX_CLIENTS 64
+#define BUF_SIZE (256 * 1024)
+
+static char *response; // header and body the origin sends
+static size_t response_len;
+static int origin_fd;
+static struct addrinfo *proxy_addr;
+static char request[256];
+static size_t request_len;
+static volatile int stop;
+
+typedef struct {
+    pthread_t tid;
+    long requests;
+    long errors;
+    long long bytes;
+} client_t;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * read the request header off fd, then send the response and close
+ */
+static void *origin_conn(void *vargp) {
+    int fd = (int)(long)vargp;
+    char buf[4096];
+    size_t len = 0;
+    ssize_t n;
+
+    while (len < sizeof(buf) - 1 &&
+           (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0) {
+        len += (size_t)n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n")) {
+            break;
+        }
+    }
+    for (size_t off = 0; off < response_len; off += (size_t)n) {
+        n = send(fd, response + off, response_len - off, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *origin(void *vargp) {
+    (void)vargp;
+    while (1) {
+        int fd = accept(origin_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, origin_conn, (void *)(long)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+/*
+ * listen on an ephemeral port of localhost
+ * return the port, or -1 on failure
+ */
+static int origin_start(size_t body_len) {
+    char head[128];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.0 200 OK\r\nContent-Length: %zu\r\n"
+                            "Content-Type: application/octet-stream\r\n\r\n",
+                            body_len);
+    response_len = (size_t)head_len + body_len;
+    response = malloc(response_len);
+    if (!response) {
+        return -1;
+    }
+    memcpy(response, head, (size_t)head_len);
+    for (size_t i = 0; i < body_len; i++) {
+        response[head_len + i] = (char)('a' + i % 26);
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    origin_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (origin_fd < 0 ||
+        bind(origin_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(origin_fd, 128) != 0 ||
+        getsockname(origin_fd, (struct sockaddr *)&addr, &addrlen) != 0) {
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, origin, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return ntohs(addr.sin_port);
+}
+
+/*
+ * fetch the response through the proxy, reading it to the end
+ * return the bytes received, or -1 on failure
+ */
+static long long fetch(char *buf) {
+    int fd = socket(proxy_addr->ai_family, proxy_addr->ai_socktype,
+                    proxy_addr->ai_protocol);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) != 0 ||
+        send(fd, request, request_len, MSG_NOSIGNAL) != (ssize_t)request_len) {
+        close(fd);
+        return -1;
+    }
+    long long total = 0;
+    ssize_t n;
+    while ((n = recv(fd, buf, BUF_SIZE, 0)) > 0) {
+        total += n;
+    }
+    close(fd);
+    return n < 0 ? -1 : total;
+}
+
+static void *client(void *vargp) {
+    client_t *c = vargp;
+    char *buf = malloc(BUF_SIZE);
+    if (!buf) {
+        return NULL;
+    }
+    while (!stop) {
+        long long n = fetch(buf);
+        if (n != (long long)response_len) {
+            c->errors++;
+            continue;
+        }
+        c->requests++;
+        c->bytes += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * user and system CPU seconds process pid used so far
+ * return false if they cannot be read
+ */
+static bool proc_cpu(long pid, double *user, double *sys) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    char line[1024];
+    bool ok = fgets(line, sizeof(line), fp) != NULL;
+    fclose(fp);
+    // fields after the command, which may hold spaces, end with ')'
+    char *p = ok ? strrchr(line, ')') : NULL;
+    unsigned long utime, stime;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                            "%lu %lu",
+                     &utime, &stime) != 2) {
+        return false;
+    }
+    long ticks = sysconf(_SC_CLK_TCK);
+    *user = (double)utime / (double)ticks;
+    *sys = (double)stime / (double)ticks;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr,
+                "usage: %s <port> [megabytes] [clients] [seconds] "
+                "[proxy pid]\n",
+                argv[0]);
+        return 1;
+    }
+    long mb = argc > 2 ? atol(argv[2]) : DEFAULT_MB;
+    int nclients = argc > 3 ? atoi(argv[3]) : DEFAULT_CLIENTS;
+    int seconds = argc > 4 ? atoi(argv[4]) : DEFAULT_SECONDS;
+    long pid = argc > 5 ? atol(argv[5]) : 0;
+    if (mb < 1 || nclients < 1 || nclients > MAX_CLIENTS || seconds < 1) {
+        fprintf(stderr, "megabytes and seconds must be at least 1, clients "
+                        "1 to %d\n",
+                MAX_CLIENTS);
+        return 1;
+    }
+
+    int origin_port = origin_start((size_t)mb * 1024 * 1024);
+    if (origin_port < 0) {
+        perror("origin");
+        return 1;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo("localhost", argv[1], &hints, &proxy_addr);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return 1;
+    }
+    request_len = (size_t)snprintf(request, sizeof(request),
+                                   "GET http://127.0.0.1:%d/%ldmb HTTP/1.0"
+                                   "\r\n\r\n",
+                                   origin_port, mb);
+
+    client_t *clients = calloc((size_t)nclients, sizeof(client_t));
+    if (!clients) {
+        perror("calloc");
+        return 1;
+    }
+    double user0 = 0, sys0 = 0, user1 = 0, sys1 = 0;
+    bool cpu = pid > 0 && proc_cpu(pid, &user0, &sys0);
+    long long start = now_ns();
+    for (int i = 0; i < nclients; i++) {
+        pthread_create(&clients[i].tid, NULL, client, &clients[i]);
+    }
+    sleep((unsigned)seconds);
+    stop = 1;
+
+    long requests = 0;
+    long errors = 0;
+    long long bytes = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(clients[i].tid, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    cpu = cpu && proc_cpu(pid, &user1, &sys1);
+
+    printf("%-8s %10s %10s %8s", "MB", "MB/s", "responses", "errors");
+    if (cpu) {
+        printf(" %14s %14s", "user s per GB", "sys s per GB");
+    }
+    printf("\n%-8ld %10.1f %10ld %8ld", mb, (double)bytes / elapsed / 1e6,
+           requests, errors);
+    if (cpu) {
+        double gb = bytes > 0 ? (double)bytes / 1e9 : 1;
+        printf(" %14.3f %14.3f", (user1 - user0) / gb, (sys1 - sys0) / gb);
+    }
+    printf("\n");
+    freeaddrinfo(proxy_addr);
+    free(clients);
+    return 0;
+}
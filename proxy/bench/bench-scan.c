@@ -0,0 +1,120 @@
+/*
+ * bench-scan.c - header lines per second through the buffered readers
+ *
+ * Another thread writes a stream of request headers into a unix socket.
+ * It is read back line by line with rio_readlineb(), which copies every
+ * byte into the caller's buffer while looking for '\n', and with
+ * reader_line(), which returns slices of its own buffer, once for every
+ * scanner the CPU can run.
+ *
+ * usage: ./bench-scan [MB per run]
+ */
+#include "csapp.h"
+#include "reader.h"
+#include "scan.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *header =
+    "GET http://www.example.com:8080/images/logo.png?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+    "Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com:8080/index.html\r\n"
+    "Cookie: session=4f1c2a9be0d84e7a; theme=dark; lang=en\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+typedef struct {
+    int fd;
+    long copies;
+} feed_t;
+
+static void *feed(void *vargp) {
+    feed_t *f = vargp;
+    size_t len = strlen(header);
+    for (long i = 0; i < f->copies; i++) {
+        if (rio_writen(f->fd, (void *)header, len) < 0) {
+            break;
+        }
+    }
+    close(f->fd);
+    return NULL;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long lines_rio(int fd) {
+    rio_t rio;
+    char line[MAXLINE];
+    long lines = 0;
+
+    rio_readinitb(&rio, fd);
+    while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+        lines++;
+    }
+    return lines;
+}
+
+static long lines_reader(int fd) {
+    reader_t rd;
+    const char *line;
+    long lines = 0;
+
+    reader_init(&rd, fd);
+    while (reader_line(&rd, &line) > 0) {
+        lines++;
+    }
+    return lines;
+}
+
+static void run(const char *name, long (*count)(int), long copies) {
+    int sv[2];
+    pthread_t tid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    feed_t f = {sv[1], copies};
+    pthread_create(&tid, NULL, feed, &f);
+
+    double start = now_sec();
+    long lines = count(sv[0]);
+    double elapsed = now_sec() - start;
+
+    pthread_join(tid, NULL);
+    close(sv[0]);
+
+    printf("%10s %14.0f %10.1f\n", name, (double)lines / elapsed,
+           (double)(strlen(header) * (size_t)copies) / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+    long mb = argc > 1 ? strtol(argv[1], NULL, 10) : 256;
+    long copies = mb * 1024 * 1024 / (long)strlen(header);
+    static const char *scanners[] = {"scalar", "sse2", "avx2"};
+
+    printf("%10s %14s %10s\n", "reader", "lines/s", "MB/s");
+    run("rio", lines_rio, copies);
+    for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+        if (scan_use(scanners[i])) {
+            run(scanners[i], lines_reader, copies);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * bench-slab.c - memory footprint of the cache under long churn
+ *
+ * Inserts objects of random sizes under random uris of random lengths, so
+ * eviction keeps freeing memory in a different order than it was taken.
+ * After every round it reports what the cache's arena has mapped, how
+ * much of that is in slots handed out and what callers asked for, next to
+ * the resident size of the whole process. Once the cache is full the
+ * mapped size should stop growing.
+ *
+ * usage: ./bench-slab [rounds] [inserts per round]
+ */
+#include "cache.h"
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * resident bytes of this process
+ */
+static size_t rss_bytes(void) {
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * mostly small objects with a few large ones, as for web pages
+ */
+static size_t random_size(void) {
+    if (rand() % 8 == 0) {
+        return 1 + (size_t)rand() % MAX_OBJECT_SIZE;
+    }
+    return 1 + (size_t)rand() % (4 * 1024);
+}
+
+int main(int argc, char **argv) {
+    long rounds = argc > 1 ? strtol(argv[1], NULL, 10) : 10;
+    long inserts = argc > 2 ? strtol(argv[2], NULL, 10) : 100000;
+    char *body = malloc(MAX_OBJECT_SIZE);
+    char key[512];
+
+    memset(body, 'x', MAX_OBJECT_SIZE);
+    init_cache(1);
+    srand(213);
+
+    printf("%6s %10s %10s %10s %10s\n", "round", "mapped KB", "in use KB",
+           "asked KB", "rss KB");
+    for (long round = 1; round <= rounds; round++) {
+        for (long i = 0; i < inserts; i++) {
+            int pad = rand() % 400;
+            snprintf(key, sizeof(key), "http://localhost:15213/%0*d", pad,
+                     rand());
+            cache_fill_t fill;
+            cache_fill_init(&fill);
+            cache_fill_append(&fill, body, random_size());
+            insert_cache_obj_to_cache(key, &fill);
+        }
+
+        slab_stats_t stats;
+        slab_stats(&stats);
+        printf("%6ld %10zu %10zu %10zu %10zu\n", round, stats.mapped / 1024,
+               stats.in_use / 1024, stats.requested / 1024,
+               rss_bytes() / 1024);
+    }
+    free(body);
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * bench-trace.c - hit ratios of the cache's eviction policies on a trace
+ *
+ * Replays a log of requested uris against the real cache, once for every
+ * policy: a lookup that hits counts its bytes as served from the cache,
+ * and a miss stores an object of the logged size, as the proxy does after
+ * fetching it, backdated by how long the end server took so that
+ * gdsf-latency sees it. Each line of a trace is a uri, optionally followed
+ * by the size of its response in bytes (DEFAULT_SIZE if missing) and the
+ * milliseconds it took to fetch (DEFAULT_LATENCY); anything after that is
+ * ignored. Without a trace, a synthetic one is replayed: requests for a
+ * Zipf-distributed working set on servers of varied latency, mixed with
+ * those of a crawler sweeping uris nobody asks for again, which keep
+ * flushing an LRU cache.
+ *
+ * The object hit ratio is the share of requests served from the cache,
+ * and the byte hit ratio the share of bytes; a policy keeping many small
+ * objects wins the first, one keeping the large ones the second. The
+ * delay hit ratio is the share of end server milliseconds saved.
+ *
+ * The cache holds MAX_CACHE_SIZE bytes, as in the proxy; to try another
+ * size, rebuild with "make clean bench-trace TRACE_CFLAGS=-DMAX_CACHE_SIZE=n".
+ *
+ * usage: ./bench-trace [trace]
+ */
+#include "cache.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SIZE (8 * 1024)
+#define DEFAULT_LATENCY 50 // ms
+
+// synthetic trace
+#define WORKING_SET 2000
+#define ZIPF_ALPHA 0.9
+#define TRACE_REQUESTS 500000
+#define SCAN_SHARE 25 // percent of requests from the crawler
+
+typedef struct {
+    char *uri;
+    size_t size;
+    unsigned latency; // ms
+} request_t;
+
+static request_t *requests;
+static size_t nrequests;
+static size_t capacity;
+
+static void add_request(const char *uri, size_t size, unsigned latency) {
+    if (nrequests == capacity) {
+        capacity = capacity ? 2 * capacity : 1024;
+        requests = realloc(requests, capacity * sizeof(request_t));
+        if (!requests) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    requests[nrequests].uri = strdup(uri);
+    requests[nrequests].size = size;
+    requests[nrequests].latency = latency;
+    nrequests++;
+}
+
+static void load_trace(const char *path) {
+    char line[8192];
+    char uri[8192];
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long size;
+        unsigned latency;
+        int fields = sscanf(line, "%8191s %llu %u", uri, &size, &latency);
+        if (fields >= 1) {
+            add_request(uri, fields >= 2 ? (size_t)size : DEFAULT_SIZE,
+                        fields >= 3 ? latency : DEFAULT_LATENCY);
+        }
+    }
+    fclose(fp);
+}
+
+/*
+ * sizes of the working set: mostly small objects with a few large ones,
+ * as for web pages
+ */
+static size_t object_size(long i) {
+    unsigned long x = (unsigned long)i * 2654435761UL;
+    if (x % 8 == 0) {
+        return 1 + x % MAX_OBJECT_SIZE;
+    }
+    return 1 + x % (16 * 1024);
+}
+
+/*
+ * latencies of the working set: most servers are near, a few far away
+ */
+static unsigned object_latency(long i) {
+    unsigned long x = (unsigned long)i * 40503UL;
+    if (x % 10 == 0) {
+        return 200 + x % 300;
+    }
+    return 5 + x % 45;
+}
+
+static void make_trace(void) {
+    double *cdf = malloc(WORKING_SET * sizeof(double));
+    char uri[64];
+    double sum = 0;
+    long crawled = 0;
+
+    for (int i = 0; i < WORKING_SET; i++) {
+        sum += 1 / pow(i + 1, ZIPF_ALPHA);
+        cdf[i] = sum;
+    }
+    srand(213);
+    for (int i = 0; i < TRACE_REQUESTS; i++) {
+        if (rand() % 100 < SCAN_SHARE) {
+            snprintf(uri, sizeof(uri), "http://crawl.example.com/%ld",
+                     crawled++);
+            add_request(uri, DEFAULT_SIZE, DEFAULT_LATENCY);
+            continue;
+        }
+        double u = sum * rand() / ((double)RAND_MAX + 1);
+        int lo = 0, hi = WORKING_SET - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        snprintf(uri, sizeof(uri), "http://www.example.com/%d", lo);
+        add_request(uri, object_size(lo), object_latency(lo));
+    }
+    free(cdf);
+}
+
+/*
+ * replay the trace on a cache evicting with policy and print its ratios
+ */
+static void replay(const char *policy) {
+    static char body[MAX_OBJECT_SIZE];
+    size_t hits = 0;
+    unsigned long long bytes = 0, hit_bytes = 0;
+    unsigned long long delay = 0, hit_delay = 0;
+    struct timespec now;
+
+    cache_use_policy(policy);
+    init_cache(1);
+    for (size_t i = 0; i < nrequests; i++) {
+        request_t *req = &requests[i];
+        bytes += req->size;
+        delay += req->latency;
+        cache_obj_t *obj = search_cache_obj(req->uri);
+        if (obj) {
+            hits++;
+            hit_bytes += req->size;
+            hit_delay += req->latency;
+            free_cache_obj(obj);
+            continue;
+        }
+        if (req->size <= MAX_OBJECT_SIZE) {
+            cache_fill_t fill;
+            cache_fill_init(&fill);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            fill.started_ns = (uint64_t)now.tv_sec * 1000000000ULL +
+                              (uint64_t)now.tv_nsec -
+                              (uint64_t)req->latency * 1000000ULL;
+            cache_fill_append(&fill, body, req->size);
+            insert_cache_obj_to_cache(req->uri, &fill);
+        }
+    }
+    printf("%12s %10zu %12.2f %10.2f %11.2f\n", policy, nrequests,
+           100.0 * (double)hits / (double)nrequests,
+           100.0 * (double)hit_bytes / (double)bytes,
+           delay ? 100.0 * (double)hit_delay / (double)delay : 0.0);
+}
+
+int main(int argc, char **argv) {
+    static const char *policies[] = {"lru", "s3fifo", "tinylfu", "gdsf",
+                                     "gdsf-latency"};
+
+    if (argc > 1) {
+        load_trace(argv[1]);
+    } else {
+        make_trace();
+    }
+    if (nrequests == 0) {
+        fprintf(stderr, "empty trace\n");
+        return 1;
+    }
+
+    printf("%12s %10s %12s %10s %11s\n", "policy", "requests",
+           "object hit %", "byte hit %", "delay hit %");
+    fflush(stdout);
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        // the cache cannot be torn down, so each policy gets a fresh one
+        pid_t pid = fork();
+        if (pid == 0) {
+            replay(policies[i]);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
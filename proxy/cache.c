@@ -1,163 +1,1354 @@
 #include "cache.h"
+#include "disk.h"
+#include "epoch.h"
+#include "sketch.h"
+#include "slab.h"
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDEX_MIN_SLOTS 64
+// queues a shard can have, the policies use up to this many
+#define CACHE_QUEUES 3
+// sizes the policies' tables of past keys, which know no object sizes
+#define EXPECTED_OBJECT_SIZE 2048
+// disk hits that bring an object back into memory
+#define DISK_PROMOTE_HITS 2
+
+/*
+ * marks an index slot whose object was removed, so probing continues past
+ * it; never dereferenced
+ */
+static cache_obj_t index_tombstone;
+#define TOMBSTONE (&index_tombstone)
+
+/*
+ * open addressing (linear probing) index over a shard's objects
+ * slots are read without the shard lock, and a full rebuild replaces
+ * the whole index so readers always see a consistent slot count
+ */
+typedef struct {
+    size_t slots; // power of two
+    cache_obj_t *slot[];
+} cache_index_t;
+
+/*
+ * objects of a shard in the order they were queued, by queue_time
+ */
+typedef struct {
+    cache_obj_t *head; // oldest
+    cache_obj_t *tail; // newest
+    size_t size;       // bytes of its objects
+} cache_queue_t;
+
+/*
+ * keys recently evicted from the s3fifo small queue: a ring of their
+ * hashes, and how many of them fall in each slot of a counting filter
+ */
+typedef struct {
+    uint64_t *ring;
+    size_t len;
+    size_t pos; // next to overwrite
+    size_t used;
+    uint8_t *counts;
+    size_t mask;
+} cache_ghost_t;
+
+/*
+ * binary min-heap of objects by priority, each knowing its place in it
+ */
+typedef struct {
+    cache_obj_t **objs;
+    size_t len;
+    size_t cap;
+} cache_heap_t;
+
+/*
+ * one independent part of the cache: a key only ever lives in the shard
+ * picked by its hash, so shards share no locks or lists
+ *
+ * hits never relink objects, they only stamp access_time, and the policy
+ * reads the stamps when it looks for a victim: a queue head hit since it
+ * was queued is not evicted but moved back as the policy says (for lru,
+ * to where its access_time belongs, which gives the same victim as
+ * moving it on every hit would have)
+ */
+typedef struct {
+    cache_queue_t queue[CACHE_QUEUES];
+    size_t size;     // bytes of whole shard
+    size_t capacity; // byte budget of this shard
+    size_t count;    // objects in the shard
+    cache_index_t *index;
+    size_t index_used;     // live objects plus tombstones
+    pthread_mutex_t mutex; // writers only
+    sketch_t sketch;       // tinylfu: lookups of recent keys
+    cache_ghost_t ghost;   // s3fifo: keys evicted from the small queue
+    cache_heap_t heap;     // gdsf: objects by priority
+    double inflation;      // gdsf: priority of the last object evicted
+} __attribute__((aligned(64))) cache_shard_t;
+
+/*
+ * an eviction policy; all but access run under the shard lock
+ */
+typedef struct {
+    const char *name;
+    // set up what the shard needs beyond its queues
+    bool (*init)(cache_shard_t *shard);
+    // a lookup of hash, hit or miss, without any lock; may be NULL
+    void (*access)(cache_shard_t *shard, uint64_t hash);
+    // queue a new object, return false if out of memory
+    bool (*admit)(cache_shard_t *shard, cache_obj_t *obj);
+    // unlink objects, chained on *evicted, until needed_size more fit
+    void (*evict)(cache_shard_t *shard, size_t needed_size,
+                  cache_obj_t **evicted);
+    // obj is being unlinked from the shard's queues; may be NULL
+    void (*remove)(cache_shard_t *shard, cache_obj_t *obj);
+} cache_policy_t;
 
 typedef struct {
-    cache_obj_t *head; // LRU
-    cache_obj_t *tail; // MRU
-    size_t size;       // bytes of whole cache
-    pthread_mutex_t mutex;
+    cache_shard_t *shards;
+    int nshards;
+    const cache_policy_t *policy;
 } cache_t;
 
 static cache_t cache;
 
 /*
- * init global cache for storing web objects
+ * 64-bit FNV-1a hash of a key
  */
-void init_cache() {
-    cache.head = NULL;
-    cache.tail = NULL;
-    cache.size = 0;
-    pthread_mutex_init(&cache.mutex, NULL);
-};
+static uint64_t hash_key(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * recency stamp for access_time and queue_time
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * pick the shard from the high bits of the hash, the low bits pick the
+ * index slot within the shard
+ */
+static cache_shard_t *shard_of(uint64_t hash) {
+    return &cache.shards[(hash >> 32) % (uint64_t)cache.nshards];
+}
+
+static cache_index_t *index_new(size_t slots) {
+    cache_index_t *index =
+        calloc(1, sizeof(cache_index_t) + slots * sizeof(cache_obj_t *));
+    if (index) {
+        index->slots = slots;
+    }
+    return index;
+}
+
+/*
+ * return the object stored under key and its slot in *pos, or NULL on a
+ * miss; safe without the shard lock inside an epoch
+ */
+static cache_obj_t *index_find(cache_index_t *index, const char *key,
+                               uint64_t hash, size_t *pos) {
+    size_t mask = index->slots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        cache_obj_t *obj = __atomic_load_n(&index->slot[i], __ATOMIC_ACQUIRE);
+        if (obj == NULL) {
+            return NULL;
+        }
+        if (obj != TOMBSTONE && obj->hash == hash &&
+            strcmp(obj->key, key) == 0) {
+            if (pos) {
+                *pos = i;
+            }
+            return obj;
+        }
+    }
+}
+
+/*
+ * the object after obj in the shard's queues, taken one after another,
+ * or the first one if obj is NULL; must hold the shard lock
+ */
+static cache_obj_t *next_cache_obj(cache_shard_t *shard, cache_obj_t *obj) {
+    int q = 0;
+    if (obj) {
+        if (obj->next) {
+            return obj->next;
+        }
+        q = obj->queue + 1;
+    }
+    for (; q < CACHE_QUEUES; q++) {
+        if (shard->queue[q].head) {
+            return shard->queue[q].head;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * put obj in the first free slot of its probe sequence
+ * the index must have room, obj is published to lock-free readers
+ */
+static void index_place(cache_index_t *index, cache_obj_t *obj) {
+    size_t mask = index->slots - 1;
+    size_t i = obj->hash & mask;
+    while (index->slot[i] != NULL && index->slot[i] != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    __atomic_store_n(&index->slot[i], obj, __ATOMIC_RELEASE);
+}
+
+/*
+ * rebuild the index with room for one more object, dropping tombstones
+ * grows only when live objects fill more than half of it
+ * a replaced index is left in *old for the caller to retire
+ * return false if out of memory
+ */
+static bool index_reserve(cache_shard_t *shard, cache_index_t **old) {
+    if ((shard->index_used + 1) * 4 <= shard->index->slots * 3) {
+        return true;
+    }
+
+    size_t slots = shard->index->slots;
+    while ((shard->count + 1) * 2 > slots) {
+        slots *= 2;
+    }
+
+    cache_index_t *index = index_new(slots);
+    if (!index) {
+        return false;
+    }
+    for (cache_obj_t *curr = next_cache_obj(shard, NULL); curr;
+         curr = next_cache_obj(shard, curr)) {
+        index_place(index, curr);
+    }
+    *old = shard->index;
+    __atomic_store_n(&shard->index, index, __ATOMIC_RELEASE);
+    shard->index_used = shard->count;
+    return true;
+}
 
-static void remove_cache_obj_from_cache(cache_obj_t *obj) {
+static void remove_cache_obj_from_cache(cache_shard_t *shard,
+                                        cache_obj_t *obj) {
     if (!obj) {
         return;
     }
+    cache_queue_t *queue = &shard->queue[obj->queue];
 
     if (obj->next) {
         obj->next->prev = obj->prev;
     } else {
-        cache.tail = obj->prev;
+        queue->tail = obj->prev;
     }
 
     if (obj->prev) {
         obj->prev->next = obj->next;
     } else {
-        cache.head = obj->next;
+        queue->head = obj->next;
     }
 
+    queue->size -= obj->size;
     obj->next = NULL;
     obj->prev = NULL;
 }
 
 /*
- * check if current cache's empty space is enough for needed_size
+ * insert a web obecjt to its queue in shard, obj->queue, after every
+ * object queued no later than it; new objects are the newest and land on
+ * the tail
+ * internal usage for specific operaion
+ */
+static void insert_cache_obj_in_order(cache_shard_t *shard,
+                                      cache_obj_t *obj) {
+    cache_queue_t *queue = &shard->queue[obj->queue];
+    cache_obj_t *prev = queue->tail;
+    while (prev && prev->queue_time > obj->queue_time) {
+        prev = prev->prev;
+    }
+
+    obj->prev = prev;
+    obj->next = prev ? prev->next : queue->head;
+    if (obj->next) {
+        obj->next->prev = obj;
+    } else {
+        queue->tail = obj;
+    }
+    if (prev) {
+        prev->next = obj;
+    } else {
+        queue->head = obj;
+    }
+    queue->size += obj->size;
+}
+
+/*
+ * move obj to the tail of queue q as if it was queued just now, so that
+ * only hits from now on count as hits since it was queued
+ */
+static void requeue_cache_obj(cache_shard_t *shard, cache_obj_t *obj,
+                              int q) {
+    remove_cache_obj_from_cache(shard, obj);
+    obj->queue = q;
+    obj->queue_time = now_ns();
+    insert_cache_obj_in_order(shard, obj);
+}
+
+/*
+ * whether obj was hit since it was last queued
+ */
+static bool hit_since_queued(const cache_obj_t *obj) {
+    return __atomic_load_n(&obj->access_time, __ATOMIC_RELAXED) >
+           obj->queue_time;
+}
+
+/*
+ * drop the cache's own reference, passed to epoch_retire so that it runs
+ * only after lock-free readers had the chance to take theirs
+ */
+static void release_cache_obj(void *vobj) {
+    free_cache_obj(vobj);
+}
+
+/*
+ * keep an object evicted from memory in the disk tier, if it can still
+ * be served: fresh, or stale but able to be revalidated
+ */
+static void demote_cache_obj(cache_obj_t *obj) {
+    if (!cache_obj_fresh(obj) && !obj->etag && !obj->last_modified) {
+        // an older copy must not come back instead
+        disk_remove(obj->key, obj->hash);
+        return;
+    }
+    // brought back from the disk, which may still hold it
+    if (obj->on_disk && disk_contains(obj->key, obj->hash)) {
+        return;
+    }
+
+    cache_record_t rec;
+    struct iovec iov[CACHE_RECORD_IOVS];
+    int iovcnt = cache_obj_record(obj, &rec, iov);
+    disk_put(obj->key, obj->hash, iov, iovcnt);
+}
+
+/*
+ * hand what an insert unlinked to epoch reclamation, outside the shard
+ * lock so that the shard is not held across the epoch lock as well;
+ * evicted objects are demoted to the disk tier first, replaced ones are
+ * not worth it
+ */
+static void retire_unlinked(cache_obj_t *evicted, cache_obj_t *replaced,
+                            cache_index_t *old_index) {
+    while (evicted) {
+        cache_obj_t *next = evicted->next;
+        evicted->next = NULL;
+        if (disk_enabled()) {
+            demote_cache_obj(evicted);
+        }
+        epoch_retire(evicted, release_cache_obj);
+        evicted = next;
+    }
+    while (replaced) {
+        cache_obj_t *next = replaced->next;
+        replaced->next = NULL;
+        epoch_retire(replaced, release_cache_obj);
+        replaced = next;
+    }
+    if (old_index) {
+        epoch_retire(old_index, free);
+    }
+}
+
+/*
+ * take obj out of shard's queue and index, and chain it on *evicted
+ */
+static void unlink_cache_obj(cache_shard_t *shard, cache_obj_t *obj,
+                             cache_obj_t **evicted) {
+    size_t pos;
+    remove_cache_obj_from_cache(shard, obj);
+    if (cache.policy->remove) {
+        cache.policy->remove(shard, obj);
+    }
+    index_find(shard->index, obj->key, obj->hash, &pos);
+    // the slot stays used until the next rebuild
+    __atomic_store_n(&shard->index->slot[pos], TOMBSTONE, __ATOMIC_RELEASE);
+    shard->size -= obj->size;
+    shard->count--;
+    // readers only reach it through the index, next is free to reuse
+    obj->next = *evicted;
+    *evicted = obj;
+}
+
+/*
+ * lru: one queue in recency order
+ * check if current shard's empty space is enough for needed_size
  * if enough: return
- * else: keep evicting LRU web_objs in cache until
+ * else: keep evicting LRU web_objs in shard until
  *       empty space >= needed_size
+ * objects still being sent to clients are evicted too, their memory is
+ * freed by the last free_cache_obj
+ * evicted objects are chained on *evicted for the caller to retire once
+ * it dropped the shard lock
  */
-static void evict_obj_in_cache(size_t needed_size) {
-    while (needed_size + cache.size > MAX_CACHE_SIZE) {
-        // clean from LRU which is not in use
-        cache_obj_t *curr = cache.head;
-        while (curr && curr->reference_cnt > 0) {
-            curr = curr->next;
+static void lru_evict(cache_shard_t *shard, size_t needed_size,
+                      cache_obj_t **evicted) {
+    // hits keep landing while we sweep, so each object is requeued at
+    // most about once per eviction
+    size_t requeues = shard->count;
+
+    while (needed_size + shard->size > shard->capacity) {
+        cache_obj_t *curr = shard->queue[0].head;
+        if (curr == NULL) {
+            break;
+        }
+
+        // hit since it was queued: not the LRU, move it where it belongs
+        uint64_t access_time =
+            __atomic_load_n(&curr->access_time, __ATOMIC_RELAXED);
+        if (requeues > 0 && access_time > curr->queue_time) {
+            remove_cache_obj_from_cache(shard, curr);
+            curr->queue_time = access_time;
+            insert_cache_obj_in_order(shard, curr);
+            requeues--;
+            continue;
+        }
+
+        unlink_cache_obj(shard, curr, evicted);
+    }
+}
+
+static bool lru_init(cache_shard_t *shard) {
+    (void)shard;
+    return true;
+}
+
+static bool lru_admit(cache_shard_t *shard, cache_obj_t *obj) {
+    obj->queue = 0;
+    insert_cache_obj_in_order(shard, obj);
+    return true;
+}
+
+/*
+ * s3fifo: a small FIFO queue (0) that new objects go through, a main
+ * FIFO queue (1), and a ghost queue of keys evicted from the small one
+ * a hit since queued is all the frequency kept: small objects that have
+ * one are promoted to main, main ones are reinserted once for it
+ */
+#define S3FIFO_SMALL 0
+#define S3FIFO_MAIN 1
+#define S3FIFO_SMALL_SHARE 10 // percent of the shard
+
+static bool s3fifo_init(cache_shard_t *shard) {
+    cache_ghost_t *ghost = &shard->ghost;
+    ghost->len = shard->capacity / EXPECTED_OBJECT_SIZE + 1;
+    ghost->ring = calloc(ghost->len, sizeof(uint64_t));
+    // a few slots per entry keep false positives rare
+    size_t slots = 16;
+    while (slots < 4 * ghost->len) {
+        slots *= 2;
+    }
+    ghost->counts = calloc(slots, 1);
+    ghost->mask = slots - 1;
+    return ghost->ring && ghost->counts;
+}
+
+static bool ghost_contains(const cache_ghost_t *ghost, uint64_t hash) {
+    return ghost->counts[hash & ghost->mask] > 0;
+}
+
+static void ghost_add(cache_ghost_t *ghost, uint64_t hash) {
+    if (ghost->used == ghost->len) {
+        ghost->counts[ghost->ring[ghost->pos] & ghost->mask]--;
+    } else {
+        ghost->used++;
+    }
+    ghost->ring[ghost->pos] = hash;
+    ghost->pos = (ghost->pos + 1) % ghost->len;
+    uint8_t *count = &ghost->counts[hash & ghost->mask];
+    if (*count < UINT8_MAX) {
+        (*count)++;
+    }
+}
+
+static bool s3fifo_admit(cache_shard_t *shard, cache_obj_t *obj) {
+    obj->queue =
+        ghost_contains(&shard->ghost, obj->hash) ? S3FIFO_MAIN : S3FIFO_SMALL;
+    insert_cache_obj_in_order(shard, obj);
+    return true;
+}
+
+static void s3fifo_evict(cache_shard_t *shard, size_t needed_size,
+                         cache_obj_t **evicted) {
+    size_t small_capacity = shard->capacity / 100 * S3FIFO_SMALL_SHARE;
+    size_t requeues = shard->count;
+
+    while (needed_size + shard->size > shard->capacity) {
+        cache_queue_t *small = &shard->queue[S3FIFO_SMALL];
+        cache_queue_t *large = &shard->queue[S3FIFO_MAIN];
+        if (small->head && (small->size > small_capacity || !large->head)) {
+            cache_obj_t *curr = small->head;
+            if (hit_since_queued(curr)) {
+                requeue_cache_obj(shard, curr, S3FIFO_MAIN);
+            } else {
+                ghost_add(&shard->ghost, curr->hash);
+                unlink_cache_obj(shard, curr, evicted);
+            }
+            continue;
         }
+
+        cache_obj_t *curr = large->head;
         if (curr == NULL) {
             break;
         }
+        if (requeues > 0 && hit_since_queued(curr)) {
+            requeue_cache_obj(shard, curr, S3FIFO_MAIN);
+            requeues--;
+            continue;
+        }
+        unlink_cache_obj(shard, curr, evicted);
+    }
+}
+
+/*
+ * tinylfu: new objects enter an LRU window (0), and those it outgrows
+ * move on to the main probation queue (1) as candidates. While the shard
+ * is over budget, the oldest candidate competes with the LRU of probation
+ * and whichever the sketch says was looked up less often is evicted.
+ * Probation objects hit since queued are promoted to the protected queue
+ * (2), whose LRU is demoted back to probation when it outgrows its share
+ */
+#define TINYLFU_WINDOW 0
+#define TINYLFU_PROBATION 1
+#define TINYLFU_PROTECTED 2
+#define TINYLFU_WINDOW_SHARE 1     // percent of the shard
+#define TINYLFU_PROTECTED_SHARE 80 // percent of the rest
+
+static bool tinylfu_init(cache_shard_t *shard) {
+    return sketch_init(&shard->sketch,
+                       shard->capacity / EXPECTED_OBJECT_SIZE + 1);
+}
+
+static void tinylfu_access(cache_shard_t *shard, uint64_t hash) {
+    sketch_add(&shard->sketch, hash);
+}
+
+static bool tinylfu_admit(cache_shard_t *shard, cache_obj_t *obj) {
+    obj->queue = TINYLFU_WINDOW;
+    insert_cache_obj_in_order(shard, obj);
+    return true;
+}
+
+/*
+ * the LRU of queue q, after moving the heads hit since queued to where
+ * they belong (to protected, for probation), at most *requeues of them
+ */
+static cache_obj_t *tinylfu_lru(cache_shard_t *shard, int q,
+                                size_t *requeues) {
+    cache_obj_t *curr;
+    while ((curr = shard->queue[q].head) && *requeues > 0 &&
+           hit_since_queued(curr)) {
+        requeue_cache_obj(shard, curr,
+                          q == TINYLFU_PROBATION ? TINYLFU_PROTECTED : q);
+        (*requeues)--;
+    }
+    return curr;
+}
+
+static void tinylfu_evict(cache_shard_t *shard, size_t needed_size,
+                          cache_obj_t **evicted) {
+    size_t window_capacity = shard->capacity / 100 * TINYLFU_WINDOW_SHARE;
+    size_t protected_capacity =
+        (shard->capacity - window_capacity) / 100 * TINYLFU_PROTECTED_SHARE;
+    size_t requeues = shard->count;
+    cache_queue_t *window = &shard->queue[TINYLFU_WINDOW];
+    cache_queue_t *probation = &shard->queue[TINYLFU_PROBATION];
+    cache_queue_t *protected = &shard->queue[TINYLFU_PROTECTED];
+
+    // candidates are queued after every older probation object
+    cache_obj_t *candidate = NULL;
+    while (window->size > window_capacity) {
+        cache_obj_t *curr = tinylfu_lru(shard, TINYLFU_WINDOW, &requeues);
+        requeue_cache_obj(shard, curr, TINYLFU_PROBATION);
+        if (!candidate) {
+            candidate = curr;
+        }
+    }
+
+    while (needed_size + shard->size > shard->capacity) {
+        cache_obj_t *victim = tinylfu_lru(shard, TINYLFU_PROBATION, &requeues);
+        while (protected->size > protected_capacity) {
+            cache_obj_t *demoted =
+                tinylfu_lru(shard, TINYLFU_PROTECTED, &requeues);
+            requeue_cache_obj(shard, demoted, TINYLFU_PROBATION);
+        }
+        if (candidate && candidate->queue != TINYLFU_PROBATION) {
+            candidate = NULL; // promoted, so no longer a candidate
+        }
+        if (!victim) {
+            victim = probation->head ? probation->head : protected->head;
+        }
+        if (!victim) {
+            victim = window->head;
+        }
+        if (!victim) {
+            break;
+        }
 
-        remove_cache_obj_from_cache(curr);
-        cache.size -= curr->size;
-        free(curr->key);
-        free(curr->web_obj);
-        free(curr);
+        if (!candidate || candidate == victim) {
+            // nothing older to compare with
+            if (candidate) {
+                candidate = candidate->next;
+            }
+            unlink_cache_obj(shard, victim, evicted);
+        } else if (sketch_estimate(&shard->sketch, candidate->hash) >
+                   sketch_estimate(&shard->sketch, victim->hash)) {
+            unlink_cache_obj(shard, victim, evicted);
+        } else {
+            cache_obj_t *next = candidate->next;
+            unlink_cache_obj(shard, candidate, evicted);
+            candidate = next;
+        }
     }
 }
 
 /*
- * insert a web obecjt (MRU) to cache's tail
- * internal usage for specific operaion
+ * gdsf: Greedy-Dual-Size-Frequency, evicting the object of least
+ * priority, inflation + frequency * cost / size, where inflation is the
+ * priority of the last object evicted, so that objects not hit for a
+ * while fall behind new ones. The cost is 1, or with gdsf-latency the
+ * milliseconds the end server took, so slow objects are kept longer.
+ * Hits cannot take the shard lock to move an object in the heap: the
+ * least object is checked for hits since its priority was set and then
+ * sifted back down with a new one instead of being evicted
  */
-static void insert_cache_obj_to_tail(cache_obj_t *obj) {
-    obj->next = NULL;
-    obj->prev = cache.tail;
-    if (cache.tail) {
-        cache.tail->next = obj;
+#define GDSF_MIN_HEAP 64
+
+static bool gdsf_init(cache_shard_t *shard) {
+    shard->heap.objs = malloc(GDSF_MIN_HEAP * sizeof(cache_obj_t *));
+    shard->heap.cap = GDSF_MIN_HEAP;
+    return shard->heap.objs != NULL;
+}
+
+static void heap_set(cache_heap_t *heap, size_t i, cache_obj_t *obj) {
+    heap->objs[i] = obj;
+    obj->heap_pos = i;
+}
+
+static void heap_sift_up(cache_heap_t *heap, size_t i) {
+    cache_obj_t *obj = heap->objs[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (heap->objs[parent]->priority <= obj->priority) {
+            break;
+        }
+        heap_set(heap, i, heap->objs[parent]);
+        i = parent;
     }
-    cache.tail = obj;
-    if (cache.head == NULL) {
-        cache.head = obj;
+    heap_set(heap, i, obj);
+}
+
+static void heap_sift_down(cache_heap_t *heap, size_t i) {
+    cache_obj_t *obj = heap->objs[i];
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->len) {
+            break;
+        }
+        if (child + 1 < heap->len &&
+            heap->objs[child + 1]->priority < heap->objs[child]->priority) {
+            child++;
+        }
+        if (obj->priority <= heap->objs[child]->priority) {
+            break;
+        }
+        heap_set(heap, i, heap->objs[child]);
+        i = child;
     }
+    heap_set(heap, i, obj);
 }
 
 /*
- * insert a web obecjt to cache
- * public usage for generally insert a new web_obj to cache
- * also include size validation checking
+ * set obj's priority from its hits so far and the current inflation
  */
-void insert_cache_obj_to_cache(char *key, size_t size, char *web_obj) {
-    if (size > MAX_OBJECT_SIZE) {
+static void gdsf_prioritize(cache_shard_t *shard, cache_obj_t *obj) {
+    uint32_t hits = __atomic_load_n(&obj->hits, __ATOMIC_RELAXED);
+    // a refresh restarts hits from 0
+    obj->freq += hits >= obj->hits_seen ? hits - obj->hits_seen : hits;
+    obj->hits_seen = hits;
+    size_t size = obj->size > 0 ? obj->size : 1;
+    obj->priority =
+        shard->inflation + (double)obj->freq * obj->cost / (double)size;
+}
+
+static bool gdsf_queue(cache_shard_t *shard, cache_obj_t *obj) {
+    cache_heap_t *heap = &shard->heap;
+    if (heap->len == heap->cap) {
+        cache_obj_t **objs =
+            realloc(heap->objs, 2 * heap->cap * sizeof(cache_obj_t *));
+        if (!objs) {
+            return false;
+        }
+        heap->objs = objs;
+        heap->cap *= 2;
+    }
+    // also kept in queue 0, only to be walked over
+    obj->queue = 0;
+    insert_cache_obj_in_order(shard, obj);
+    obj->freq = 1;
+    obj->hits_seen = 0;
+    gdsf_prioritize(shard, obj);
+    heap->objs[heap->len] = obj;
+    heap_sift_up(heap, heap->len++);
+    return true;
+}
+
+static bool gdsf_admit(cache_shard_t *shard, cache_obj_t *obj) {
+    obj->cost = 1;
+    return gdsf_queue(shard, obj);
+}
+
+static bool gdsf_latency_admit(cache_shard_t *shard, cache_obj_t *obj) {
+    // a response from memory or a local server still cost something
+    obj->cost = obj->fetch_ms > 0 ? obj->fetch_ms : 1;
+    return gdsf_queue(shard, obj);
+}
+
+static void gdsf_remove(cache_shard_t *shard, cache_obj_t *obj) {
+    cache_heap_t *heap = &shard->heap;
+    size_t i = obj->heap_pos;
+    cache_obj_t *last = heap->objs[--heap->len];
+    if (last == obj) {
         return;
     }
+    heap_set(heap, i, last);
+    if (last->priority < obj->priority) {
+        heap_sift_up(heap, i);
+    } else {
+        heap_sift_down(heap, i);
+    }
+}
+
+static void gdsf_evict(cache_shard_t *shard, size_t needed_size,
+                       cache_obj_t **evicted) {
+    cache_heap_t *heap = &shard->heap;
+    size_t requeues = shard->count;
+
+    while (needed_size + shard->size > shard->capacity && heap->len > 0) {
+        cache_obj_t *least = heap->objs[0];
+        if (requeues > 0 &&
+            __atomic_load_n(&least->hits, __ATOMIC_RELAXED) !=
+                least->hits_seen) {
+            gdsf_prioritize(shard, least);
+            heap_sift_down(heap, 0);
+            requeues--;
+            continue;
+        }
+        shard->inflation = least->priority;
+        unlink_cache_obj(shard, least, evicted);
+    }
+}
+
+static const cache_policy_t policies[] = {
+    {"lru", lru_init, NULL, lru_admit, lru_evict, NULL},
+    {"s3fifo", s3fifo_init, NULL, s3fifo_admit, s3fifo_evict, NULL},
+    {"tinylfu", tinylfu_init, tinylfu_access, tinylfu_admit, tinylfu_evict,
+     NULL},
+    {"gdsf", gdsf_init, NULL, gdsf_admit, gdsf_evict, gdsf_remove},
+    {"gdsf-latency", gdsf_init, NULL, gdsf_latency_admit, gdsf_evict,
+     gdsf_remove},
+};
+
+bool cache_use_policy(const char *name) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (!strcmp(policies[i].name, name)) {
+            cache.policy = &policies[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cache_use_disk(const char *path, size_t size) {
+    return disk_open(path, size);
+}
+
+/*
+ * init global cache for storing web objects
+ * split into nshards shards whose byte budgets add up to MAX_CACHE_SIZE
+ * every shard must still fit a MAX_OBJECT_SIZE object, which caps nshards
+ */
+void init_cache(int nshards) {
+    if (nshards < 1) {
+        nshards = 1;
+    }
+    if (nshards > MAX_CACHE_SIZE / MAX_OBJECT_SIZE) {
+        nshards = MAX_CACHE_SIZE / MAX_OBJECT_SIZE;
+    }
+
+    if (!cache.policy) {
+        cache.policy = &policies[0];
+    }
+    cache.nshards = nshards;
+    cache.shards = calloc((size_t)nshards, sizeof(cache_shard_t));
+    for (int i = 0; i < nshards; i++) {
+        cache_shard_t *shard = &cache.shards[i];
+        // calloc left the queues empty
+        shard->size = 0;
+        // the first shards take the remainder of the division
+        shard->capacity = MAX_CACHE_SIZE / nshards +
+                          (i < MAX_CACHE_SIZE % nshards ? 1 : 0);
+        shard->count = 0;
+        shard->index = index_new(INDEX_MIN_SLOTS);
+        shard->index_used = 0;
+        pthread_mutex_init(&shard->mutex, NULL);
+        if (!cache.policy->init(shard)) {
+            fprintf(stderr, "could not set up the %s cache policy\n",
+                    cache.policy->name);
+            exit(1);
+        }
+    }
+};
+
+static void free_segments(cache_segment_t *seg) {
+    while (seg) {
+        cache_segment_t *next = seg->next;
+        slab_free(seg, sizeof(cache_segment_t));
+        seg = next;
+    }
+}
+
+/*
+ * start an empty fill
+ */
+void cache_fill_init(cache_fill_t *fill) {
+    fill->head = NULL;
+    fill->tail = NULL;
+    fill->size = 0;
+    fill->overflow = false;
+    fill->keep_alive = false;
+    fill->started_ns = 0;
+    fill->lifetime = -1;
+    fill->etag[0] = '\0';
+    fill->last_modified[0] = '\0';
+}
+
+void cache_fill_start(cache_fill_t *fill) {
+    fill->started_ns = now_ns();
+}
+
+/*
+ * copy a validator of len bytes into dst, unless it does not fit
+ */
+static void copy_validator(char *dst, const char *src, size_t len) {
+    dst[0] = '\0';
+    if (src && len > 0 && len < CACHE_VALIDATOR_SIZE) {
+        memcpy(dst, src, len);
+        dst[len] = '\0';
+    }
+}
+
+/*
+ * note how long the response stays fresh and its validators
+ */
+void cache_fill_freshness(cache_fill_t *fill, long long lifetime,
+                          const char *etag, size_t etag_len,
+                          const char *last_modified,
+                          size_t last_modified_len) {
+    fill->lifetime = lifetime;
+    copy_validator(fill->etag, etag, etag_len);
+    copy_validator(fill->last_modified, last_modified, last_modified_len);
+}
+
+/*
+ * drop everything stored, fill is empty again
+ */
+void cache_fill_discard(cache_fill_t *fill) {
+    free_segments(fill->head);
+    fill->head = NULL;
+    fill->tail = NULL;
+    fill->size = 0;
+}
+
+/*
+ * store the next n bytes of a response
+ * return false, dropping everything stored, once the response can no
+ * longer become a cache object
+ */
+bool cache_fill_append(cache_fill_t *fill, const char *buf, size_t n) {
+    if (fill->overflow) {
+        return false;
+    }
+    if (fill->size + n > MAX_OBJECT_SIZE) {
+        fill->overflow = true;
+        cache_fill_discard(fill);
+        return false;
+    }
 
-    pthread_mutex_lock(&cache.mutex);
+    fill->size += n;
+    while (n > 0) {
+        cache_segment_t *seg = fill->tail;
+        if (!seg || seg->len == CACHE_SEGMENT_SIZE) {
+            seg = slab_alloc(sizeof(cache_segment_t));
+            if (!seg) {
+                fill->overflow = true;
+                cache_fill_discard(fill);
+                return false;
+            }
+            seg->next = NULL;
+            seg->len = 0;
+            if (fill->tail) {
+                fill->tail->next = seg;
+            } else {
+                fill->head = seg;
+            }
+            fill->tail = seg;
+        }
 
-    // D15/D16 avoid duplicate insertion
-    cache_obj_t *curr = cache.head;
-    while (curr) {
-        if (strcmp(curr->key, key) == 0) {
-            pthread_mutex_unlock(&cache.mutex);
-            return;
+        size_t copy = CACHE_SEGMENT_SIZE - seg->len;
+        if (copy > n) {
+            copy = n;
         }
-        curr = curr->next;
+        memcpy(seg->data + seg->len, buf, copy);
+        seg->len += copy;
+        buf += copy;
+        n -= copy;
+    }
+    return true;
+}
+
+/*
+ * bytes of the slot holding obj and the strings behind it, which take
+ * strings bytes with their NULs
+ */
+static size_t cache_obj_slot_size(size_t strings) {
+    return sizeof(cache_obj_t) + strings;
+}
+
+/*
+ * bytes of the key and validators behind obj
+ */
+static size_t cache_obj_strings(const cache_obj_t *obj) {
+    size_t strings = strlen(obj->key) + 1;
+    if (obj->etag) {
+        strings += strlen(obj->etag) + 1;
+    }
+    if (obj->last_modified) {
+        strings += strlen(obj->last_modified) + 1;
+    }
+    return strings;
+}
+
+/*
+ * copy str to *pos and advance it past the copy
+ * return the copy, or NULL for an empty str
+ */
+static char *put_string(char **pos, const char *str) {
+    if (!str[0]) {
+        return NULL;
+    }
+    size_t len = strlen(str) + 1;
+    char *copy = memcpy(*pos, str, len);
+    *pos += len;
+    return copy;
+}
+
+/*
+ * make an object of key and the body stored in fill, fill is left empty
+ * the key and validators are kept right behind the object in the same
+ * slot
+ * return NULL, fill untouched, if out of memory
+ */
+static cache_obj_t *new_cache_obj(const char *key, uint64_t hash,
+                                  cache_fill_t *fill) {
+    size_t strings = strlen(key) + 1;
+    if (fill->etag[0]) {
+        strings += strlen(fill->etag) + 1;
+    }
+    if (fill->last_modified[0]) {
+        strings += strlen(fill->last_modified) + 1;
+    }
+    cache_obj_t *obj = slab_alloc(cache_obj_slot_size(strings));
+    if (!obj) {
+        return NULL;
     }
 
-    evict_obj_in_cache(size);
-    // create cache_obj ==========
-    cache_obj_t *obj = malloc(sizeof(cache_obj_t));
-    obj->key = strdup(key);
-    obj->web_obj = malloc(size);
-    memcpy(obj->web_obj, web_obj, size);
-    obj->size = size;
-    obj->reference_cnt = 0;
+    char *pos = (char *)(obj + 1);
+    obj->key = put_string(&pos, key);
+    obj->etag = put_string(&pos, fill->etag);
+    obj->last_modified = put_string(&pos, fill->last_modified);
+    obj->hash = hash;
+    obj->body = fill->head;
+    obj->size = fill->size;
+    obj->keep_alive = fill->keep_alive;
+    obj->fetch_ms =
+        fill->started_ns ? (uint32_t)((now_ns() - fill->started_ns) / 1000000)
+                         : 0;
+    obj->lifetime = fill->lifetime;
+    obj->expires = time(NULL) + (time_t)(obj->lifetime > 0 ? obj->lifetime : 0);
+    cache_fill_init(fill);
+    obj->reference_cnt = 1; // the cache's own
+    obj->hits = 0;
+    obj->refreshing = 0;
+    obj->on_disk = false;
     obj->prev = NULL;
     obj->next = NULL;
-    // ============================
-    insert_cache_obj_to_tail(obj);
-    cache.size += size;
-    pthread_mutex_unlock(&cache.mutex);
+    return obj;
+}
+
+/*
+ * put obj in the cache, taking over the reference it holds
+ * a stale object under the same key is replaced, a fresh one is kept
+ * unless obj would stay fresh for longer; when restoring, any is kept
+ */
+static void cache_insert(cache_obj_t *obj, bool restoring) {
+    cache_shard_t *shard = shard_of(obj->hash);
+    cache_obj_t *evicted = NULL;
+    cache_obj_t *replaced = NULL;
+    cache_index_t *old_index = NULL;
+    size_t size = obj->size;
+    pthread_mutex_lock(&shard->mutex);
+
+    // D15/D16 avoid duplicate insertion, unless it replaces a stale one
+    // or a refresh ahead of its expiry
+    cache_obj_t *old = index_find(shard->index, obj->key, obj->hash, NULL);
+    if (old && (restoring || (cache_obj_fresh(old) &&
+                              (obj->lifetime < 0 ||
+                               (old->lifetime >= 0 &&
+                                obj->expires <= old->expires))))) {
+        pthread_mutex_unlock(&shard->mutex);
+        free_cache_obj(obj);
+        return;
+    }
+    if (old) {
+        unlink_cache_obj(shard, old, &replaced);
+    }
+
+    cache.policy->evict(shard, size, &evicted);
+    if (!index_reserve(shard, &old_index)) {
+        pthread_mutex_unlock(&shard->mutex);
+        retire_unlinked(evicted, replaced, NULL);
+        free_cache_obj(obj);
+        return;
+    }
+    obj->access_time = now_ns();
+    obj->queue_time = obj->access_time;
+    if (!cache.policy->admit(shard, obj)) {
+        pthread_mutex_unlock(&shard->mutex);
+        retire_unlinked(evicted, replaced, old_index);
+        free_cache_obj(obj);
+        return;
+    }
+    shard->count++;
+    shard->size += size;
+    index_place(shard->index, obj);
+    shard->index_used++;
+    pthread_mutex_unlock(&shard->mutex);
+    retire_unlinked(evicted, replaced, old_index);
+}
+
+/*
+ * insert a web obecjt to cache
+ * public usage for generally insert a new web_obj to cache
+ * the body is taken over from fill without copying, fill is left empty
+ */
+void insert_cache_obj_to_cache(const char *key, cache_fill_t *fill) {
+    if (fill->overflow || fill->size > MAX_OBJECT_SIZE) {
+        cache_fill_discard(fill);
+        return;
+    }
+
+    // allocate before locking, the arena has locks of its own
+    cache_obj_t *obj = new_cache_obj(key, hash_key(key), fill);
+    if (!obj) {
+        cache_fill_discard(fill);
+        return;
+    }
+    cache_insert(obj, false);
 };
 
+int cache_obj_record(const cache_obj_t *obj, cache_record_t *rec,
+                     struct iovec *iov) {
+    rec->lifetime = obj->lifetime;
+    rec->expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+    rec->fetch_ms = obj->fetch_ms;
+    rec->etag_len = obj->etag ? (uint16_t)(strlen(obj->etag) + 1) : 0;
+    rec->last_modified_len =
+        obj->last_modified ? (uint16_t)(strlen(obj->last_modified) + 1) : 0;
+    rec->keep_alive = obj->keep_alive;
+
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = rec;
+    iov[iovcnt++].iov_len = sizeof(cache_record_t);
+    if (obj->etag) {
+        iov[iovcnt].iov_base = obj->etag;
+        iov[iovcnt++].iov_len = rec->etag_len;
+    }
+    if (obj->last_modified) {
+        iov[iovcnt].iov_base = obj->last_modified;
+        iov[iovcnt++].iov_len = rec->last_modified_len;
+    }
+    for (cache_segment_t *seg = obj->body; seg; seg = seg->next) {
+        iov[iovcnt].iov_base = seg->data;
+        iov[iovcnt++].iov_len = seg->len;
+    }
+    return iovcnt;
+}
+
+/*
+ * whether the len bytes at str are a string with its NUL, or none at all
+ */
+static bool record_string_ok(const char *str, size_t len) {
+    return len == 0 || (len <= CACHE_VALIDATOR_SIZE && str[len - 1] == '\0' &&
+                        strlen(str) == len - 1);
+}
+
+cache_obj_t *cache_obj_from_record(const char *key, const char *data,
+                                   size_t len) {
+    cache_record_t rec;
+    if (len < sizeof(rec)) {
+        return NULL;
+    }
+    memcpy(&rec, data, sizeof(rec));
+    const char *etag = data + sizeof(rec);
+    const char *last_modified = etag + rec.etag_len;
+    const char *body = last_modified + rec.last_modified_len;
+    if (sizeof(rec) + rec.etag_len + rec.last_modified_len > len ||
+        !record_string_ok(etag, rec.etag_len) ||
+        !record_string_ok(last_modified, rec.last_modified_len)) {
+        return NULL;
+    }
+
+    cache_fill_t fill;
+    cache_fill_init(&fill);
+    cache_fill_freshness(&fill, rec.lifetime, etag,
+                         rec.etag_len ? rec.etag_len - 1u : 0, last_modified,
+                         rec.last_modified_len ? rec.last_modified_len - 1u
+                                               : 0);
+    fill.keep_alive = rec.keep_alive;
+    if (!cache_fill_append(&fill, body, len - (size_t)(body - data))) {
+        return NULL;
+    }
+    cache_obj_t *obj = new_cache_obj(key, hash_key(key), &fill);
+    if (!obj) {
+        cache_fill_discard(&fill);
+        return NULL;
+    }
+    obj->expires = (time_t)rec.expires;
+    obj->fetch_ms = rec.fetch_ms;
+    return obj;
+}
+
+void cache_restore(cache_obj_t *obj) {
+    cache_insert(obj, true);
+}
+
+cache_obj_t **cache_objects(size_t *n) {
+    cache_obj_t **objs = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+
+    for (int i = 0; i < cache.nshards; i++) {
+        cache_shard_t *shard = &cache.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        if (count + shard->count > cap) {
+            cap = count + shard->count;
+            cache_obj_t **grown = realloc(objs, cap * sizeof(cache_obj_t *));
+            if (!grown) {
+                pthread_mutex_unlock(&shard->mutex);
+                break;
+            }
+            objs = grown;
+        }
+        for (cache_obj_t *obj = next_cache_obj(shard, NULL); obj;
+             obj = next_cache_obj(shard, obj)) {
+            __atomic_fetch_add(&obj->reference_cnt, 1, __ATOMIC_RELAXED);
+            objs[count++] = obj;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    *n = count;
+    return objs;
+}
+
+/*
+ * look for a record in the disk tier, copied out under the disk lock
+ */
+typedef struct {
+    const char *key;
+    cache_obj_t *obj;
+} disk_load_t;
+
+static void copy_from_disk(void *arg, const char *data, size_t len) {
+    disk_load_t *load = arg;
+    load->obj = cache_obj_from_record(load->key, data, len);
+}
+
+/*
+ * look for key in the disk tier after a miss in memory
+ * return an object of the caller's own, which is also put back in the
+ * cache once hit DISK_PROMOTE_HITS times on disk, or NULL on a miss
+ */
+static cache_obj_t *load_cache_obj(const char *key, uint64_t hash) {
+    disk_load_t load = {.key = key, .obj = NULL};
+    unsigned hits = disk_get(key, hash, copy_from_disk, &load);
+    cache_obj_t *obj = load.obj;
+    if (!obj) {
+        return NULL;
+    }
+    obj->on_disk = true;
+
+    if (hits >= DISK_PROMOTE_HITS) {
+        cache_obj_hold(obj); // the cache's own
+        cache_insert(obj, false);
+    }
+    return obj;
+}
+
 /*
  * search if a uri request had been cached by passing it as a key
- * if hit: return the cache_obj
+ * never takes a lock, unless it misses in memory and looks on disk
+ * if hit: return the cache_obj, valid until free_cache_obj even if evicted
  * else miss: return NULL
  */
 cache_obj_t *search_cache_obj(const char *key) {
-    pthread_mutex_lock(&cache.mutex);
+    uint64_t hash = hash_key(key);
+    cache_shard_t *shard = shard_of(hash);
+    cache_obj_t *obj = NULL;
 
-    cache_obj_t *curr = cache.head;
+    epoch_enter();
+    cache_index_t *index = __atomic_load_n(&shard->index, __ATOMIC_ACQUIRE);
+    obj = index_find(index, key, hash, NULL);
     // hit
-    while (curr) {
-        if (strcmp(curr->key, key) == 0) {
-            curr->reference_cnt++; // increment when a thread retrieves it from
-                                   // cache
-            // move that cache_obj to tail: make it LRU
-            if (cache.tail != curr) {
-                remove_cache_obj_from_cache(curr);
-                insert_cache_obj_to_tail(curr);
-            };
-            pthread_mutex_unlock(&cache.mutex);
-            return curr;
-        }
-        curr = curr->next;
-    }
-
-    // miss
-    pthread_mutex_unlock(&cache.mutex);
-    return NULL;
+    if (obj) {
+        // even if evicted meanwhile, the cache's reference is only dropped
+        // after this epoch, so the count cannot have reached 0 yet
+        __atomic_fetch_add(&obj->reference_cnt, 1, __ATOMIC_RELAXED);
+        // make it MRU without relinking it
+        __atomic_store_n(&obj->access_time, now_ns(), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&obj->hits, 1, __ATOMIC_RELAXED);
+    }
+    epoch_exit();
+    if (cache.policy->access) {
+        cache.policy->access(shard, hash);
+    }
+
+    if (!obj && disk_enabled()) {
+        obj = load_cache_obj(key, hash);
+    }
+    return obj;
 };
 
+void cache_obj_hold(cache_obj_t *obj) {
+    __atomic_fetch_add(&obj->reference_cnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * whether obj can still be served without asking the end server
+ */
+bool cache_obj_fresh(const cache_obj_t *obj) {
+    return obj->lifetime < 0 ||
+           time(NULL) < __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * make obj fresh again for lifetime seconds, or its old lifetime
+ * lock-free like a hit: only the expiry changes, and a reader racing with
+ * it sees either the old or the new one
+ */
+void cache_obj_refresh(cache_obj_t *obj, long long lifetime) {
+    if (lifetime < 0) {
+        lifetime = obj->lifetime;
+    }
+    time_t expires = time(NULL) + (time_t)(lifetime > 0 ? lifetime : 0);
+    __atomic_store_n(&obj->expires, expires, __ATOMIC_RELAXED);
+    // only hits on the refreshed object make it hot again
+    __atomic_store_n(&obj->hits, 0, __ATOMIC_RELAXED);
+}
+
+int cache_expiring_hot(cache_obj_t **objs, int n, time_t ahead) {
+    time_t now = time(NULL);
+    int found = 0;
+
+    for (int i = 0; i < cache.nshards && n > 0; i++) {
+        cache_shard_t *shard = &cache.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (cache_obj_t *obj = next_cache_obj(shard, NULL); obj;
+             obj = next_cache_obj(shard, obj)) {
+            uint32_t hits = __atomic_load_n(&obj->hits, __ATOMIC_RELAXED);
+            time_t expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+            if (hits == 0 || obj->lifetime < 0 || expires <= now ||
+                expires > now + ahead) {
+                continue;
+            }
+            // insertion into objs, kept sorted by hits
+            int pos = found < n ? found : n - 1;
+            if (found == n) {
+                if (hits <= objs[pos]->hits) {
+                    continue;
+                }
+                free_cache_obj(objs[pos]);
+            } else {
+                found++;
+            }
+            while (pos > 0 && objs[pos - 1]->hits < hits) {
+                objs[pos] = objs[pos - 1];
+                pos--;
+            }
+            __atomic_fetch_add(&obj->reference_cnt, 1, __ATOMIC_RELAXED);
+            objs[pos] = obj;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return found;
+}
+
+int cache_obj_iov(const cache_obj_t *obj, size_t off, struct iovec *iov,
+                  int n) {
+    int iovcnt = 0;
+
+    const cache_segment_t *seg = obj->body;
+    while (seg && off >= seg->len) {
+        off -= seg->len;
+        seg = seg->next;
+    }
+    for (; seg && iovcnt < n; seg = seg->next) {
+        iov[iovcnt].iov_base = (char *)seg->data + off;
+        iov[iovcnt].iov_len = seg->len - off;
+        iovcnt++;
+        off = 0;
+    }
+    return iovcnt;
+}
+
+/*
+ * write the body of obj from byte off on with a single writev
+ * return what write(2) returns, so the caller loops until obj->size
+ */
+ssize_t cache_obj_write(int fd, const cache_obj_t *obj, size_t off) {
+    struct iovec iov[CACHE_OBJ_IOVS];
+    return writev(fd, iov, cache_obj_iov(obj, off, iov, CACHE_OBJ_IOVS));
+}
+
 /*
  * free a cache_obj whicin was in use in the cache
+ * the last reference frees its memory
  */
 void free_cache_obj(cache_obj_t *obj) {
     if (!obj)
         return;
-    pthread_mutex_lock(&cache.mutex);
-    obj->reference_cnt--;
-    pthread_mutex_unlock(&cache.mutex);
-};
\ No newline at end of file
+    if (__atomic_sub_fetch(&obj->reference_cnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_segments(obj->body);
+        slab_free(obj, cache_obj_slot_size(cache_obj_strings(obj)));
+    }
+};
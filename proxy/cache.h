@@ -1,39 +1,247 @@
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #ifndef CACHE_H
 #define CACHE_H
 
 #define MAX_OBJECT_SIZE (100 * 1024)
+// overridable so the trace simulator can try other sizes
+#ifndef MAX_CACHE_SIZE
 #define MAX_CACHE_SIZE (1024 * 1024)
+#endif
+// longest ETag or Last-Modified value kept, with its NUL
+#define CACHE_VALIDATOR_SIZE 128
+// data bytes per segment, so that a whole segment is one 8 KB slab slot
+#define CACHE_SEGMENT_SIZE (8 * 1024 - sizeof(void *) - sizeof(size_t))
+
+/*
+ * bodies are kept in fixed-size segments, filled once while the
+ * response is relayed and never copied or moved afterwards
+ */
+typedef struct cache_segment {
+    struct cache_segment *next;
+    size_t len; // bytes used of data
+    char data[CACHE_SEGMENT_SIZE];
+} cache_segment_t;
+
+/* a response being stored while it is relayed */
+typedef struct {
+    cache_segment_t *head;
+    cache_segment_t *tail;
+    size_t size;         // bytes stored so far
+    bool overflow;       // outgrew MAX_OBJECT_SIZE or ran out of memory
+    bool keep_alive;     // the response leaves its connection open
+    uint64_t started_ns; // see cache_fill_start, 0 if not timed
+    // freshness, see cache_fill_freshness
+    long long lifetime;
+    char etag[CACHE_VALIDATOR_SIZE];
+    char last_modified[CACHE_VALIDATOR_SIZE];
+} cache_fill_t;
 
 typedef struct cache_obj {
-    char *key; // uri
-    char *web_obj;
-    size_t size; // bytes of web_obj
+    char *key;     // uri, stored right behind the object
+    uint64_t hash; // hash of key, compared before the key itself
+    cache_segment_t *body;
+    size_t size;     // bytes of body
+    bool keep_alive; // a client connection can take more requests after it
+    // validators, stored behind the key, NULL if the response had none
+    char *etag;
+    char *last_modified;
+    long long lifetime; // seconds it stays fresh, negative for ever
+    time_t expires;     // when it goes stale, updated atomically
+    // readers holding it, plus one while the cache does, updated atomically
+    // the object is freed when this drops to 0
     int reference_cnt;
+    uint64_t access_time; // ns of the last hit, stamped without any lock
+    uint64_t queue_time;  // access_time when last placed in its queue
+    int queue;            // which of the shard's queues it is in
+    uint32_t hits;        // since it was cached or refreshed, without a lock
+    int refreshing;       // queued for a background refresh, set atomically
+    uint32_t fetch_ms;    // how long the end server took to send it
+    bool on_disk;         // read back from the disk tier, which may keep it
+    // gdsf: place in the shard's heap, and priority from cost and hits
+    size_t heap_pos;
+    double priority;
+    uint32_t cost;
+    uint32_t freq;
+    uint32_t hits_seen; // hits when priority was last set
     struct cache_obj *prev;
     struct cache_obj *next;
 } cache_obj_t;
 
+/*
+ * an object as stored outside memory, by the disk tier and in snapshots:
+ * this, then its validators with their NULs, then its body; the key is
+ * kept apart
+ */
+typedef struct {
+    int64_t lifetime;
+    int64_t expires; // time_t
+    uint32_t fetch_ms;
+    uint16_t etag_len; // with the NUL, 0 if none
+    uint16_t last_modified_len;
+    bool keep_alive;
+} cache_record_t;
+
+// iovecs a whole MAX_OBJECT_SIZE body takes
+#define CACHE_OBJ_IOVS                                                         \
+    ((int)((MAX_OBJECT_SIZE + CACHE_SEGMENT_SIZE - 1) / CACHE_SEGMENT_SIZE))
+// iovecs a record of an object can take
+#define CACHE_RECORD_IOVS (3 + CACHE_OBJ_IOVS)
+
+/*
+ * pick the eviction policy by name, before init_cache:
+ *   lru      evict the least recently hit object (the default)
+ *   s3fifo   new objects pass through a small FIFO queue and only those
+ *            hit there, or recently evicted from it, reach the main one
+ *   tinylfu  new objects wait in a small LRU window and then only
+ *            displace a main object looked up less often (W-TinyLFU)
+ *   gdsf     evict the object of least hits per byte, aged by what was
+ *            evicted before it (Greedy-Dual-Size-Frequency)
+ *   gdsf-latency  the same, but hits also weigh by fetch_ms
+ * return false if there is no such policy
+ */
+bool cache_use_policy(const char *name);
+
+/*
+ * keep objects evicted from memory in a second tier, a file of size bytes
+ * at path, and serve misses in memory from it; see disk.h
+ * return false if the file cannot be set up
+ */
+bool cache_use_disk(const char *path, size_t size);
+
 /*
  * init global cache for storing web objects
+ * split into nshards shards, picked by key hash, each with its own lock,
+ * eviction queues and share of MAX_CACHE_SIZE
+ */
+void init_cache(int nshards);
+
+/*
+ * start an empty fill
+ */
+void cache_fill_init(cache_fill_t *fill);
+
+/*
+ * note that the end server is being asked for the response now, so the
+ * object can tell how long it took once inserted
+ */
+void cache_fill_start(cache_fill_t *fill);
+
+/*
+ * store the next n bytes of a response
+ * return false, dropping everything stored, once the response can no
+ * longer become a cache object
  */
-void init_cache();
+bool cache_fill_append(cache_fill_t *fill, const char *buf, size_t n);
+
+/*
+ * note how long the response stays fresh, in seconds from now or
+ * negative for as long as it stays in the cache, and the validators to
+ * revalidate it with once it is stale, which may be NULL; validators
+ * longer than CACHE_VALIDATOR_SIZE are not kept
+ */
+void cache_fill_freshness(cache_fill_t *fill, long long lifetime,
+                          const char *etag, size_t etag_len,
+                          const char *last_modified, size_t last_modified_len);
+
+/*
+ * drop everything stored, fill is empty again
+ */
+void cache_fill_discard(cache_fill_t *fill);
 
 /*
  * insert a web obecjt to cache
+ * the body is taken over from fill without copying, fill is left empty
+ * a stale object under the same key is replaced, a fresh one is kept
+ * unless obj would stay fresh for longer
  */
-void insert_cache_obj_to_cache(char *key, size_t size, char *web_obj);
+void insert_cache_obj_to_cache(const char *key, cache_fill_t *fill);
 
 /*
  * search if a uri request had been cached by passing it as a key
- * if hit: return the cache_obj
+ * never takes a lock, unless it misses in memory and looks on disk
+ * if hit: return the cache_obj, valid until free_cache_obj even if evicted
  * else miss: return NULL
  */
 cache_obj_t *search_cache_obj(const char *key);
 
+/*
+ * take another reference to obj, also released with free_cache_obj
+ */
+void cache_obj_hold(cache_obj_t *obj);
+
+/*
+ * whether obj can still be served without asking the end server
+ */
+bool cache_obj_fresh(const cache_obj_t *obj);
+
+/*
+ * make obj fresh again after the end server said it did not change, for
+ * lifetime seconds, or for as long as it was given before if negative
+ */
+void cache_obj_refresh(cache_obj_t *obj, long long lifetime);
+
+/*
+ * find the objects most worth refreshing before they go stale: up to n
+ * of the most hit ones that were hit at all and expire in the next ahead
+ * seconds, most hit first, each with a reference the caller releases
+ * with free_cache_obj
+ * return how many were put in objs
+ */
+int cache_expiring_hot(cache_obj_t **objs, int n, time_t ahead);
+
+/*
+ * describe obj as a record, in rec and the CACHE_RECORD_IOVS entries of
+ * iov, which point into rec and obj
+ * return how many entries of iov it took
+ */
+int cache_obj_record(const cache_obj_t *obj, cache_record_t *rec,
+                     struct iovec *iov);
+
+/*
+ * make an object of key from the len bytes of a record at data, as
+ * gathered from the iov of cache_obj_record; it is not in the cache and
+ * its only reference is the caller's
+ * return NULL if the record is malformed or out of memory
+ */
+cache_obj_t *cache_obj_from_record(const char *key, const char *data,
+                                   size_t len);
+
+/*
+ * put obj, made by cache_obj_from_record, in the cache unless its key
+ * is cached already; the caller's reference is taken over
+ */
+void cache_restore(cache_obj_t *obj);
+
+/*
+ * take a reference to every object in the cache, shard by shard in
+ * eviction order, so that restoring them in this order keeps it
+ * return an array of them, *n long, which the caller frees after
+ * releasing each object with free_cache_obj; short if out of memory
+ */
+cache_obj_t **cache_objects(size_t *n);
+
+/*
+ * point iov, which has room for n entries, at the body of obj from byte
+ * off on
+ * return how many entries it took
+ */
+int cache_obj_iov(const cache_obj_t *obj, size_t off, struct iovec *iov,
+                  int n);
+
+/*
+ * write the body of obj from byte off on with a single writev
+ * return what write(2) returns, so the caller loops until obj->size
+ */
+ssize_t cache_obj_write(int fd, const cache_obj_t *obj, size_t off);
+
 /*
  * free a cache_obj whicin was in use in the cache
  */
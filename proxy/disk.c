@@ -0,0 +1,251 @@
+/*
+ * disk.c - log-structured record store in a memory-mapped file
+ *
+ * Offsets into the log only ever grow, and a record at offset off lives
+ * at off % size in the file. Everything between tail and head is covered
+ * by records, so the oldest one can always be found at tail and dropped
+ * when head needs its space. A record never wraps around the end of the
+ * file: the space left there is filled with a padding record instead.
+ * Index entries hang off a hash table with a bucket for every
+ * DISK_BYTES_PER_BUCKET bytes of file, and find their record by offset.
+ */
+#include "disk.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DISK_ALIGN 32
+#define DISK_MAGIC 0x70787964 // "pxyd"
+#define DISK_BYTES_PER_BUCKET (8 * 1024)
+
+/*
+ * head of every record in the file, followed by the key with its NUL and
+ * the data; padding records have no key
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t len; // bytes of the whole record, a multiple of DISK_ALIGN
+    uint64_t hash;
+    uint32_t key_len; // with the NUL, 0 for padding
+    uint32_t data_len;
+    uint64_t offset; // log offset it was written at
+} disk_record_t;
+
+typedef struct disk_entry {
+    struct disk_entry *next;
+    uint64_t hash;
+    uint64_t offset; // of its record in the log
+    unsigned hits;
+} disk_entry_t;
+
+static struct {
+    bool enabled;
+    pthread_mutex_t mutex;
+    char *map;
+    size_t size;   // bytes of the file, a multiple of DISK_ALIGN
+    uint64_t head; // log offset the next record goes to
+    uint64_t tail; // log offset of the oldest record
+    disk_entry_t **buckets;
+    size_t mask; // buckets - 1, a power of two
+} disk = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static disk_record_t *record_at(uint64_t offset) {
+    return (disk_record_t *)(disk.map + offset % disk.size);
+}
+
+static const char *record_key(const disk_record_t *rec) {
+    return (const char *)(rec + 1);
+}
+
+bool disk_open(const char *path, size_t size) {
+    size -= size % DISK_ALIGN;
+    if (size < DISK_MIN_SIZE) {
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    // allocate every block now, a write to a hole in a full file system
+    // would fault instead of failing
+    if (ftruncate(fd, (off_t)size) != 0 ||
+        posix_fallocate(fd, 0, (off_t)size) != 0) {
+        close(fd);
+        return false;
+    }
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    size_t buckets = 16;
+    while (buckets * DISK_BYTES_PER_BUCKET < size) {
+        buckets *= 2;
+    }
+    disk.buckets = calloc(buckets, sizeof(disk_entry_t *));
+    if (!disk.buckets) {
+        munmap(map, size);
+        return false;
+    }
+    disk.mask = buckets - 1;
+    disk.map = map;
+    disk.size = size;
+    disk.head = 0;
+    disk.tail = 0;
+    disk.enabled = true;
+    return true;
+}
+
+bool disk_enabled(void) {
+    return disk.enabled;
+}
+
+/*
+ * return the link pointing at key's entry, or at the NULL ending its
+ * bucket on a miss; must hold disk.mutex
+ */
+static disk_entry_t **find_entry(const char *key, uint64_t hash) {
+    disk_entry_t **link = &disk.buckets[hash & disk.mask];
+    for (; *link; link = &(*link)->next) {
+        disk_entry_t *entry = *link;
+        if (entry->hash == hash &&
+            strcmp(record_key(record_at(entry->offset)), key) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+/*
+ * drop the oldest record, and its entry unless a newer record of the
+ * same key replaced it; must hold disk.mutex
+ */
+static void drop_oldest(void) {
+    disk_record_t *rec = record_at(disk.tail);
+    if (rec->key_len) {
+        disk_entry_t **link = &disk.buckets[rec->hash & disk.mask];
+        for (; *link; link = &(*link)->next) {
+            if ((*link)->offset == disk.tail) {
+                disk_entry_t *entry = *link;
+                *link = entry->next;
+                free(entry);
+                break;
+            }
+        }
+    }
+    disk.tail += rec->len;
+}
+
+/*
+ * make room for len bytes at head, dropping the oldest records in the way
+ * return the log offset they start at; must hold disk.mutex
+ */
+static uint64_t log_reserve(size_t len) {
+    while (disk.head + len - disk.tail > disk.size) {
+        drop_oldest();
+    }
+    uint64_t offset = disk.head;
+    disk.head += len;
+    return offset;
+}
+
+bool disk_put(const char *key, uint64_t hash, const struct iovec *iov,
+              int iovcnt) {
+    size_t key_len = strlen(key) + 1;
+    size_t data_len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        data_len += iov[i].iov_len;
+    }
+    size_t len = sizeof(disk_record_t) + key_len + data_len;
+    len = (len + DISK_ALIGN - 1) / DISK_ALIGN * DISK_ALIGN;
+    if (len > disk.size / 2) {
+        return false;
+    }
+    disk_entry_t *entry = malloc(sizeof(disk_entry_t));
+    if (!entry) {
+        return false;
+    }
+
+    pthread_mutex_lock(&disk.mutex);
+    size_t room = disk.size - disk.head % disk.size;
+    if (room < len) {
+        uint64_t offset = log_reserve(room);
+        disk_record_t *pad = record_at(offset);
+        pad->magic = DISK_MAGIC;
+        pad->len = (uint32_t)room;
+        pad->hash = 0;
+        pad->key_len = 0;
+        pad->data_len = 0;
+        pad->offset = offset;
+    }
+    // one entry per key, the old record is left for the log to overwrite
+    disk_entry_t **link = find_entry(key, hash);
+    if (*link) {
+        disk_entry_t *old = *link;
+        *link = old->next;
+        free(old);
+    }
+    uint64_t offset = log_reserve(len);
+
+    disk_record_t *rec = record_at(offset);
+    rec->magic = DISK_MAGIC;
+    rec->len = (uint32_t)len;
+    rec->hash = hash;
+    rec->key_len = (uint32_t)key_len;
+    rec->data_len = (uint32_t)data_len;
+    rec->offset = offset;
+    char *pos = memcpy(rec + 1, key, key_len);
+    pos += key_len;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+
+    entry->hash = hash;
+    entry->offset = offset;
+    entry->hits = 0;
+    link = &disk.buckets[hash & disk.mask];
+    entry->next = *link;
+    *link = entry;
+    pthread_mutex_unlock(&disk.mutex);
+    return true;
+}
+
+unsigned disk_get(const char *key, uint64_t hash,
+                  void (*copy)(void *arg, const char *data, size_t len),
+                  void *arg) {
+    unsigned hits = 0;
+
+    pthread_mutex_lock(&disk.mutex);
+    disk_entry_t *entry = *find_entry(key, hash);
+    if (entry) {
+        disk_record_t *rec = record_at(entry->offset);
+        copy(arg, record_key(rec) + rec->key_len, rec->data_len);
+        hits = ++entry->hits;
+    }
+    pthread_mutex_unlock(&disk.mutex);
+    return hits;
+}
+
+bool disk_contains(const char *key, uint64_t hash) {
+    pthread_mutex_lock(&disk.mutex);
+    bool found = *find_entry(key, hash) != NULL;
+    pthread_mutex_unlock(&disk.mutex);
+    return found;
+}
+
+void disk_remove(const char *key, uint64_t hash) {
+    pthread_mutex_lock(&disk.mutex);
+    disk_entry_t **link = find_entry(key, hash);
+    if (*link) {
+        disk_entry_t *entry = *link;
+        *link = entry->next;
+        free(entry);
+    }
+    pthread_mutex_unlock(&disk.mutex);
+}
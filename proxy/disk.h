@@ -0,0 +1,63 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Second cache tier in a file, enabled with "./proxy -d file <port>".
+ *
+ * The file is allocated at its full size up front and mapped, and records
+ * are appended to it as a log that wraps around: a new record overwrites
+ * the oldest ones, which drop out of the index, so the disk evicts in
+ * FIFO order. The index stays in memory, one small entry per record
+ * whatever its size, so gigabytes of records need only megabytes of RAM.
+ * One lock guards the log and the index, and records are copied in and
+ * out of the mapping under it without any system call.
+ */
+#define DISK_CACHE_SIZE (1024L * 1024 * 1024)
+// smallest file, so that a MAX_OBJECT_SIZE record still fits many times
+#define DISK_MIN_SIZE (4L * 1024 * 1024)
+
+/*
+ * open or create the file at path, size bytes large
+ * return false on failure
+ */
+bool disk_open(const char *path, size_t size);
+
+/*
+ * whether disk_open succeeded, so the tier is worth looking in
+ */
+bool disk_enabled(void);
+
+/*
+ * store the iovcnt buffers of iov as the record of key, hash its hash,
+ * replacing any record key had
+ * return false if it does not fit in the file
+ */
+bool disk_put(const char *key, uint64_t hash, const struct iovec *iov,
+              int iovcnt);
+
+/*
+ * look up the record of key; on a hit copy is called with it, still under
+ * the disk lock, and must not keep data
+ * return how often the record was hit so far, this one included, or 0 on
+ * a miss
+ */
+unsigned disk_get(const char *key, uint64_t hash,
+                  void (*copy)(void *arg, const char *data, size_t len),
+                  void *arg);
+
+/*
+ * whether key has a record
+ */
+bool disk_contains(const char *key, uint64_t hash);
+
+/*
+ * forget the record of key, if any
+ */
+void disk_remove(const char *key, uint64_t hash);
+
+#endif
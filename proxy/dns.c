@@ -0,0 +1,243 @@
+/*
+ * dns.c - cache of end server addresses
+ *
+ * Entries hang off a small hash table keyed by "host:port", under one
+ * lock that is never held across getaddrinfo(). The thread that misses
+ * on a name leaves an entry marked resolving in the table and looks the
+ * name up without the lock; threads missing on it meanwhile sleep until
+ * the answer is filled in. Expired entries are refreshed in place, or
+ * pruned from a bucket whenever a new name is added to it.
+ */
+#include "dns.h"
+#include "csapp.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DNS_BUCKETS 64
+
+typedef struct dns_entry {
+    struct dns_entry *next;
+    bool resolving; // a thread is looking it up, the rest is not set yet
+    time_t expires;
+    int error; // getaddrinfo error, 0 if res holds the addresses
+    dns_result_t res;
+    char key[]; // host:port
+} dns_entry_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t done; // some lookup finished
+    int waiting;         // threads sleeping on done
+    int count;           // entries in all buckets
+    dns_stats_t stats;
+    dns_entry_t *buckets[DNS_BUCKETS];
+} dns = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+         .done = PTHREAD_COND_INITIALIZER};
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * FNV-1a, as for the cache index
+ */
+static dns_entry_t **bucket_of(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return &dns.buckets[hash % DNS_BUCKETS];
+}
+
+/*
+ * free the expired entries of bucket, must hold dns.mutex
+ */
+static void prune_bucket(dns_entry_t **bucket, time_t now) {
+    dns_entry_t **pp = bucket;
+    while (*pp) {
+        dns_entry_t *entry = *pp;
+        if (!entry->resolving && now >= entry->expires) {
+            *pp = entry->next;
+            free(entry);
+            dns.count--;
+        } else {
+            pp = &entry->next;
+        }
+    }
+}
+
+/*
+ * the entry for key in bucket, or NULL; must hold dns.mutex
+ */
+static dns_entry_t *find(dns_entry_t **bucket, const char *key) {
+    for (dns_entry_t *entry = *bucket; entry; entry = entry->next) {
+        if (!strcmp(entry->key, key)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * a new entry for key in bucket, unless the table is full even without
+ * its expired entries; must hold dns.mutex
+ */
+static dns_entry_t *add(dns_entry_t **bucket, const char *key, time_t now) {
+    prune_bucket(bucket, now);
+    if (dns.count >= DNS_MAX_ENTRIES) {
+        for (int i = 0; i < DNS_BUCKETS; i++) {
+            prune_bucket(&dns.buckets[i], now);
+        }
+        if (dns.count >= DNS_MAX_ENTRIES) {
+            return NULL;
+        }
+    }
+
+    size_t key_len = strlen(key);
+    dns_entry_t *entry = malloc(sizeof(dns_entry_t) + key_len + 1);
+    if (!entry) {
+        return NULL;
+    }
+    memcpy(entry->key, key, key_len + 1);
+    entry->next = *bucket;
+    *bucket = entry;
+    dns.count++;
+    return entry;
+}
+
+/*
+ * wake every thread waiting for a lookup, must hold dns.mutex
+ * one signal per sleeper rather than a broadcast, as for flights
+ */
+static void wake_waiting(void) {
+    for (int i = 0; i < dns.waiting; i++) {
+        pthread_cond_signal(&dns.done);
+    }
+}
+
+/*
+ * ask getaddrinfo, keeping the first DNS_MAX_ADDRS addresses
+ */
+static int lookup(const char *host, const char *port, dns_result_t *res) {
+    struct addrinfo hints;
+    struct addrinfo *listp;
+
+    res->naddrs = 0;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM; /* Open a connection */
+    hints.ai_flags = AI_NUMERICSERV; /* ... using a numeric port arg. */
+    hints.ai_flags |= AI_ADDRCONFIG; /* Recommended for connections */
+    int rc = getaddrinfo(host, port, &hints, &listp);
+    if (rc != 0) {
+        return rc;
+    }
+
+    for (struct addrinfo *p = listp; p && res->naddrs < DNS_MAX_ADDRS;
+         p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        dns_addr_t *addr = &res->addrs[res->naddrs++];
+        addr->family = p->ai_family;
+        addr->socktype = p->ai_socktype;
+        addr->protocol = p->ai_protocol;
+        addr->addrlen = p->ai_addrlen;
+        memcpy(&addr->addr, p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(listp);
+    return 0;
+}
+
+int dns_resolve(const char *host, const char *port, dns_result_t *res) {
+    char key[MAXLINE];
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    dns_entry_t **bucket = bucket_of(key);
+    dns_entry_t *entry;
+    bool waited = false;
+
+    pthread_mutex_lock(&dns.mutex);
+    while ((entry = find(bucket, key)) && entry->resolving) {
+        waited = true;
+        dns.waiting++;
+        pthread_cond_wait(&dns.done, &dns.mutex);
+        dns.waiting--;
+    }
+
+    time_t now = now_sec();
+    if (entry && now < entry->expires) {
+        int rc = entry->error;
+        *res = entry->res;
+        dns.stats.hits++;
+        dns.stats.negative += rc != 0;
+        dns.stats.coalesced += waited;
+        pthread_mutex_unlock(&dns.mutex);
+        return rc;
+    }
+
+    // missing or expired: look it up for everybody, or just for us if
+    // there is no room to keep it
+    if (!entry) {
+        entry = add(bucket, key, now);
+    }
+    if (entry) {
+        entry->resolving = true;
+    }
+    dns.stats.misses++;
+    pthread_mutex_unlock(&dns.mutex);
+
+    int rc = lookup(host, port, res);
+
+    if (entry) {
+        pthread_mutex_lock(&dns.mutex);
+        entry->resolving = false;
+        entry->error = rc;
+        entry->res = *res;
+        entry->expires = now_sec() + (rc ? DNS_NEGATIVE_TTL : DNS_TTL);
+        wake_waiting();
+        pthread_mutex_unlock(&dns.mutex);
+    }
+    return rc;
+}
+
+int dns_open_clientfd(const char *host, const char *port) {
+    dns_result_t res;
+
+    int rc = dns_resolve(host, port, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port,
+                gai_strerror(rc));
+        return -2;
+    }
+
+    /* Walk the list for one that we can successfully connect to */
+    for (int i = 0; i < res.naddrs; i++) {
+        dns_addr_t *addr = &res.addrs[i];
+        int clientfd = socket(addr->family, addr->socktype, addr->protocol);
+        if (clientfd < 0) {
+            continue;
+        }
+        if (connect(clientfd, (struct sockaddr *)&addr->addr,
+                    addr->addrlen) == 0) {
+            return clientfd;
+        }
+        close(clientfd);
+    }
+    return -1;
+}
+
+void dns_stats(dns_stats_t *stats) {
+    pthread_mutex_lock(&dns.mutex);
+    *stats = dns.stats;
+    pthread_mutex_unlock(&dns.mutex);
+}
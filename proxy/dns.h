@@ -0,0 +1,62 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+/*
+ * Cache of end server addresses, keyed by host and port.
+ *
+ * getaddrinfo() is slow and serializes on the resolver's locks, so its
+ * answer is kept for DNS_TTL seconds, and a failure for DNS_NEGATIVE_TTL
+ * seconds so that a bad name does not cost a lookup per request. Threads
+ * that miss on a name somebody is already resolving wait for that answer
+ * instead of asking again. getaddrinfo() does not pass on the record's own
+ * TTL, hence the fixed ones. At most DNS_MAX_ENTRIES names are kept;
+ * beyond that, lookups are not cached.
+ */
+#define DNS_TTL 60
+#define DNS_NEGATIVE_TTL 5
+#define DNS_MAX_ENTRIES 256
+#define DNS_MAX_ADDRS 8 // addresses kept per name
+
+typedef struct {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} dns_addr_t;
+
+typedef struct {
+    int naddrs;
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+} dns_result_t;
+
+/* lookups since the start */
+typedef struct {
+    size_t hits;      // answered from the cache
+    size_t negative;  // hits on a failed lookup
+    size_t coalesced; // hits that waited for somebody else's lookup
+    size_t misses;    // sent to getaddrinfo
+} dns_stats_t;
+
+/*
+ * the stream socket addresses of host:port, in getaddrinfo's order
+ * return 0, or the getaddrinfo error code
+ */
+int dns_resolve(const char *host, const char *port, dns_result_t *res);
+
+/*
+ * open_clientfd() over the cached addresses of host:port
+ * return a connected socket, -2 if the name does not resolve, or -1 if
+ * no address could be connected to
+ */
+int dns_open_clientfd(const char *host, const char *port);
+
+/*
+ * copy of the counters
+ */
+void dns_stats(dns_stats_t *stats);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * epoch.c - epoch-based reclamation
+ *
+ * There is a global epoch counter. A reader publishes the epoch it saw
+ * when entering a critical section. Anything retired during epoch e is
+ * kept on limbo list e % 3 and destroyed once the global epoch reaches
+ * e + 2, which can only happen after every reader that was inside a
+ * critical section during epoch e has left it. Readers never lock or
+ * allocate; writers advance the epoch when they retire something.
+ */
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define EPOCH_LISTS 3
+
+/* per-thread published state, reused after its thread exits */
+typedef struct epoch_record {
+    unsigned long state; // (epoch << 1) | 1 inside a critical section, or 0
+    int in_use;          // owned by a live thread
+    struct epoch_record *next;
+} __attribute__((aligned(64))) epoch_record_t;
+
+typedef struct retired {
+    void *ptr;
+    void (*destroy)(void *);
+    struct retired *next;
+} retired_t;
+
+static struct {
+    unsigned long global;
+    epoch_record_t *records; // every record ever made, never freed
+    pthread_mutex_t mutex;   // serializes retire and epoch advances
+    retired_t *limbo[EPOCH_LISTS];
+} epoch = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record_t *self;
+
+/*
+ * thread exit: leave the record to the next thread that needs one
+ */
+static void record_release(void *vrec) {
+    epoch_record_t *rec = vrec;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void record_key_init(void) {
+    if (pthread_key_create(&record_key, record_release) != 0) {
+        fprintf(stderr, "epoch: could not create thread key\n");
+        exit(1);
+    }
+}
+
+static epoch_record_t *record_acquire(void) {
+    epoch_record_t *rec;
+
+    pthread_once(&record_once, record_key_init);
+
+    // reuse the record of a thread that has exited
+    rec = __atomic_load_n(&epoch.records, __ATOMIC_ACQUIRE);
+    for (; rec; rec = rec->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &expected, 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            pthread_setspecific(record_key, rec);
+            return rec;
+        }
+    }
+
+    if (posix_memalign((void **)&rec, sizeof(epoch_record_t),
+                       sizeof(epoch_record_t)) != 0) {
+        fprintf(stderr, "epoch: out of memory\n");
+        exit(1);
+    }
+    rec->state = 0;
+    rec->in_use = 1;
+    rec->next = __atomic_load_n(&epoch.records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&epoch.records, &rec->next, rec,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+    pthread_setspecific(record_key, rec);
+    return rec;
+}
+
+/*
+ * start a read-side critical section, must not be nested
+ */
+void epoch_enter(void) {
+    if (!self) {
+        self = record_acquire();
+    }
+    unsigned long e = __atomic_load_n(&epoch.global, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->state, (e << 1) | 1, __ATOMIC_RELAXED);
+    // publish the epoch before reading anything it protects
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * end the read-side critical section
+ */
+void epoch_exit(void) {
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * advance the global epoch if every reader has caught up with it
+ * return the list that became safe to destroy, must hold epoch.mutex
+ */
+static retired_t *epoch_try_advance(void) {
+    unsigned long e = epoch.global;
+    epoch_record_t *rec = __atomic_load_n(&epoch.records, __ATOMIC_ACQUIRE);
+
+    for (; rec; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && (state >> 1) != e) {
+            return NULL;
+        }
+    }
+
+    __atomic_store_n(&epoch.global, e + 1, __ATOMIC_RELEASE);
+    // retired two epochs ago: (e + 1) - 2
+    retired_t *safe = epoch.limbo[(e + 2) % EPOCH_LISTS];
+    epoch.limbo[(e + 2) % EPOCH_LISTS] = NULL;
+    return safe;
+}
+
+/*
+ * call destroy(ptr) once no reader can still hold ptr
+ * ptr must already be unreachable for new readers
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+    retired_t *r = malloc(sizeof(retired_t));
+    if (!r) {
+        // cannot tell when it is safe, leaking beats a use after free
+        return;
+    }
+    r->ptr = ptr;
+    r->destroy = destroy;
+
+    // order the caller's unlink before the reader scan below
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&epoch.mutex);
+    unsigned long e = epoch.global;
+    r->next = epoch.limbo[e % EPOCH_LISTS];
+    epoch.limbo[e % EPOCH_LISTS] = r;
+    retired_t *safe = epoch_try_advance();
+    pthread_mutex_unlock(&epoch.mutex);
+
+    while (safe) {
+        retired_t *next = safe->next;
+        safe->destroy(safe->ptr);
+        free(safe);
+        safe = next;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation for data read without locks.
+ *
+ * Readers bracket every lock-free access with epoch_enter()/epoch_exit().
+ * A writer that unlinks something readers might still be looking at hands
+ * it to epoch_retire() instead of freeing it; it is destroyed once every
+ * thread that could have seen it has left its critical section.
+ */
+
+/*
+ * start a read-side critical section, must not be nested
+ */
+void epoch_enter(void);
+
+/*
+ * end the read-side critical section
+ */
+void epoch_exit(void);
+
+/*
+ * call destroy(ptr) once no reader can still hold ptr
+ * ptr must already be unreachable for new readers
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *));
+
+#endif
@@ -0,0 +1,696 @@
+/*
+ * event.c - edge-triggered epoll engine
+ *
+ * Instead of parking a thread on every connection, each connection is a
+ * small state machine that is advanced whenever one of its sockets becomes
+ * ready:
+ *
+ *   READ_REQUEST -> (hit)  SERVE_CACHE ---------------------------> close
+ *                -> (miss) CONNECT -> SEND_REQUEST -> RELAY_HEAD
+ *                -> (bad)  SEND_ERROR ----------------------------> close
+ *
+ *   RELAY_HEAD -> RELAY ---------------------------------------> close
+ *              -> (304 for a stale hit) SERVE_CACHE -----------> close
+ *
+ * Both sockets of a connection are registered once, for reading and
+ * writing, with EPOLLET. A state handler keeps going until read() or
+ * write() returns EAGAIN, so an edge can never be missed. A few loop
+ * threads, each owning an epoll instance, share the listening socket
+ * through EPOLLEXCLUSIVE so an incoming connection wakes only one loop,
+ * or each listen on a socket of their own (see listener.h).
+ */
+#define _GNU_SOURCE
+
+#include "event.h"
+#include "cache.h"
+#include "csapp.h"
+#include "dns.h"
+#include "http.h"
+#include "listener.h"
+#include "refresh.h"
+#include "tunnel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+
+typedef enum {
+    CONN_READ_REQUEST, // accumulating the client's request header
+    CONN_CONNECT,      // non-blocking connect to the end server
+    CONN_SEND_REQUEST, // writing the rewritten request to the end server
+    CONN_RELAY_HEAD,   // reading the response header, to judge it first
+    CONN_RELAY,        // streaming the response from end server to client
+    CONN_SERVE_CACHE,  // writing a cached web object to the client
+    CONN_SEND_ERROR,   // writing an error response, then close
+} conn_state_t;
+
+/* result of running the handler of the current state */
+typedef enum {
+    STEP_NEXT,  // state changed, run the next handler right away
+    STEP_WAIT,  // a socket would block, wait for its next edge
+    STEP_CLOSE, // transaction over, tear the connection down
+} step_t;
+
+typedef struct conn conn_t;
+
+/* one socket of a connection, as registered with epoll */
+typedef struct {
+    int fd;
+    uint32_t events; // readiness reported since it was registered
+    conn_t *conn;
+} endpoint_t;
+
+struct conn {
+    conn_state_t state;
+    bool closed;
+    conn_t *next_closed;
+
+    endpoint_t client;
+    endpoint_t server;
+    dns_result_t addrs; // end server addresses
+    int next_addr;      // next one to try connecting to
+
+    // request to the end server, pointing into req and buf
+    http_request_t req;
+    struct iovec req_iov[HTTP_REQUEST_IOVS];
+    struct iovec *req_next; // first iovec not fully sent
+    int req_iovcnt;         // iovecs left from req_next
+
+    // error response to the client
+    char *out;
+    size_t out_len;
+    size_t out_off;
+
+    // cache hit being written to the client
+    cache_obj_t *obj;
+    size_t obj_off;
+    // stale hit being revalidated, served if the end server says 304
+    cache_obj_t *stale;
+
+    // response being relayed, kept for the cache while it still fits
+    char *key;
+    cache_fill_t fill;
+    bool cachable;
+
+    // request header bytes, then reused as the relay buffer
+    size_t len;
+    size_t off;
+    char buf[MAXBUF];
+};
+
+typedef struct {
+    int id;
+    int epfd;
+    int listenfd;
+    conn_t *closed; // freed after the current batch of events
+    const listeners_t *listeners;
+} loop_t;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int loop_add(loop_t *loop, endpoint_t *ep) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+    ep->events = 0;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+
+static conn_t *conn_new(int fd) {
+    conn_t *c = malloc(sizeof(conn_t));
+    if (!c) {
+        return NULL;
+    }
+    c->state = CONN_READ_REQUEST;
+    c->closed = false;
+    c->next_closed = NULL;
+    c->client.fd = fd;
+    c->client.events = 0;
+    c->client.conn = c;
+    c->server.fd = -1;
+    c->server.events = 0;
+    c->server.conn = c;
+    c->addrs.naddrs = 0;
+    c->next_addr = 0;
+    c->req_next = c->req_iov;
+    c->req_iovcnt = 0;
+    c->out = NULL;
+    c->out_len = 0;
+    c->out_off = 0;
+    c->obj = NULL;
+    c->obj_off = 0;
+    c->stale = NULL;
+    c->key = NULL;
+    cache_fill_init(&c->fill);
+    c->cachable = false;
+    c->len = 0;
+    c->off = 0;
+    return c;
+}
+
+/*
+ * close both sockets and release everything but the conn itself, which
+ * may still be referenced by events later in the same batch
+ */
+static void conn_close(loop_t *loop, conn_t *c) {
+    if (c->closed) {
+        return;
+    }
+    c->closed = true;
+
+    close(c->client.fd);
+    if (c->server.fd >= 0) {
+        close(c->server.fd);
+    }
+    free_cache_obj(c->obj);
+    free_cache_obj(c->stale);
+    free(c->out);
+    free(c->key);
+    cache_fill_discard(&c->fill);
+
+    c->next_closed = loop->closed;
+    loop->closed = c;
+}
+
+/*
+ * write the pending error response to fd
+ * STEP_NEXT once all of it is written
+ */
+static step_t write_out(conn_t *c, int fd) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return STEP_WAIT;
+            }
+            return STEP_CLOSE;
+        }
+        c->out_off += (size_t)n;
+    }
+    free(c->out);
+    c->out = NULL;
+    return STEP_NEXT;
+}
+
+static step_t conn_error(conn_t *c, const char *errnum, const char *shortmsg,
+                         const char *longmsg) {
+    c->out = malloc(MAXLINE + MAXBUF);
+    if (!c->out) {
+        return STEP_CLOSE;
+    }
+    c->out_len = http_format_error(c->out, MAXLINE + MAXBUF, errnum,
+                                   shortmsg, longmsg);
+    c->out_off = 0;
+    if (c->out_len == 0) {
+        return STEP_CLOSE;
+    }
+    c->state = CONN_SEND_ERROR;
+    return STEP_NEXT;
+}
+
+/*
+ * check whether the empty line ending the header in buf has arrived
+ * the scan resumes where the previous one left off
+ * return the length of the header with that line, or 0 if incomplete
+ */
+static size_t header_end(conn_t *c) {
+    return http_head_end(c->buf, c->len, &c->off);
+}
+
+/*
+ * start connecting to the next address of the end server
+ */
+static step_t conn_connect_next(loop_t *loop, conn_t *c) {
+    while (c->next_addr < c->addrs.naddrs) {
+        dns_addr_t *p = &c->addrs.addrs[c->next_addr++];
+
+        int fd =
+            socket(p->family, p->socktype | SOCK_NONBLOCK, p->protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int rc = connect(fd, (struct sockaddr *)&p->addr, p->addrlen);
+        if (rc < 0 && errno != EINPROGRESS) {
+            close(fd);
+            continue;
+        }
+
+        c->server.fd = fd;
+        if (loop_add(loop, &c->server) < 0) {
+            close(fd);
+            c->server.fd = -1;
+            return STEP_CLOSE;
+        }
+        if (rc == 0) {
+            c->server.events |= EPOLLOUT;
+        }
+        c->state = CONN_CONNECT;
+        return STEP_NEXT;
+    }
+    return STEP_CLOSE;
+}
+
+/*
+ * hand a CONNECT over to a tunnel, with whatever the client sent after
+ * its header, and close this loop's side of it
+ */
+static step_t conn_tunnel(loop_t *loop, conn_t *c) {
+    size_t head = header_end(c);
+    size_t early = head > 0 ? c->len - head : 0;
+
+    if (dns_resolve(c->req.host, c->req.port, &c->addrs) != 0) {
+        return conn_error(c, "502", "Bad Gateway",
+                          "Proxy could not resolve the end server");
+    }
+    if (!tunnel_open(c->client.fd, &c->addrs, c->buf + head, early)) {
+        return conn_error(c, "503", "Service Unavailable",
+                          "Proxy could not open a tunnel");
+    }
+    // the tunnel's copy of the socket would keep it registered here
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->client.fd, NULL);
+    return STEP_CLOSE;
+}
+
+/*
+ * parse the buffered request header, then serve it from the cache or
+ * start fetching it from the end server
+ */
+static step_t conn_start_request(loop_t *loop, conn_t *c) {
+    http_request_t *req = &c->req;
+    http_error_t err;
+
+    if (!http_request_parse(req, c->buf, c->len, &err)) {
+        return conn_error(c, err.errnum, err.shortmsg, err.longmsg);
+    }
+    if (req->method == HTTP_METHOD_CONNECT) {
+        return conn_tunnel(loop, c);
+    }
+
+    // check if the request is cached before calling server
+    cache_obj_t *obj = search_cache_obj(req->uri);
+    bool hit = obj && cache_obj_fresh(obj);
+    if (obj && !hit && refresh_enabled()) {
+        // served stale while a refresher asks the end server
+        refresh_submit(obj);
+        hit = true;
+    }
+    if (hit) {
+        c->obj = obj;
+        c->obj_off = 0;
+        c->state = CONN_SERVE_CACHE;
+        return STEP_NEXT;
+    }
+    // stale: ask whether it changed if it can be asked, else refetch it
+    if (obj && (obj->etag || obj->last_modified)) {
+        c->stale = obj;
+        req->if_none_match = obj->etag;
+        req->if_modified_since = obj->last_modified;
+    } else {
+        free_cache_obj(obj);
+    }
+
+    c->key = strdup(req->uri);
+    if (!c->key) {
+        return STEP_CLOSE;
+    }
+    cache_fill_start(&c->fill);
+    // sent straight from buf, which is not reused before that
+    c->req_iovcnt = http_request_iov(req, false, c->req_iov);
+    c->req_next = c->req_iov;
+
+    // name resolution still blocks this loop on a cache miss, the
+    // connect does not
+    if (dns_resolve(req->host, req->port, &c->addrs) != 0) {
+        return STEP_CLOSE;
+    }
+    c->next_addr = 0;
+    return conn_connect_next(loop, c);
+}
+
+static step_t do_read_request(loop_t *loop, conn_t *c) {
+    while (!header_end(c)) {
+        if (c->len == sizeof(c->buf) - 1) {
+            return conn_error(c, "400", "Bad Request",
+                              "Proxy could not fit the request headers");
+        }
+        ssize_t n =
+            read(c->client.fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return STEP_WAIT;
+            }
+            return STEP_CLOSE;
+        }
+        if (n == 0) {
+            // client is done sending, serve whatever lines did arrive
+            if (!memchr(c->buf, '\n', c->len)) {
+                return STEP_CLOSE;
+            }
+            break;
+        }
+        c->len += (size_t)n;
+    }
+    c->buf[c->len] = '\0';
+    return conn_start_request(loop, c);
+}
+
+static step_t do_connect(loop_t *loop, conn_t *c) {
+    if (!(c->server.events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        return STEP_WAIT;
+    }
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err != 0) {
+        // closing also drops it from the epoll set
+        close(c->server.fd);
+        c->server.fd = -1;
+        return conn_connect_next(loop, c);
+    }
+
+    c->state = CONN_SEND_REQUEST;
+    return STEP_NEXT;
+}
+
+static step_t do_send_request(conn_t *c) {
+    while (c->req_iovcnt > 0) {
+        ssize_t n = writev(c->server.fd, c->req_next, c->req_iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return STEP_WAIT;
+            }
+            return STEP_CLOSE;
+        }
+        c->req_next = http_iov_advance(c->req_next, &c->req_iovcnt, (size_t)n);
+    }
+    c->len = 0;
+    c->off = 0;
+    c->cachable = true;
+    c->state = CONN_RELAY_HEAD;
+    return STEP_NEXT;
+}
+
+/*
+ * save the n relayed bytes in buf while the response still fits in a
+ * cache object
+ */
+static void conn_fill(conn_t *c, size_t n) {
+    if (c->cachable && !cache_fill_append(&c->fill, c->buf, n)) {
+        c->cachable = false;
+    }
+}
+
+/*
+ * read the response header before relaying anything, to learn whether
+ * and for how long it may be cached, and whether a stale hit is still
+ * good; a header too big for buf is relayed as it is and not cached
+ */
+static step_t do_relay_head(conn_t *c) {
+    size_t head_len;
+    while (!(head_len = header_end(c)) && c->len < sizeof(c->buf) - 1) {
+        ssize_t n = read(c->server.fd, c->buf + c->len,
+                         sizeof(c->buf) - 1 - c->len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return STEP_WAIT;
+            }
+            return STEP_CLOSE;
+        }
+        if (n == 0) {
+            break;
+        }
+        c->len += (size_t)n;
+    }
+    c->buf[c->len] = '\0';
+
+    http_response_t resp;
+    bool parsed = head_len && http_response_parse(&resp, c->buf, head_len);
+    long long lifetime = parsed ? http_response_lifetime(&resp, time(NULL)) : 0;
+    if (!parsed || !http_response_cachable(&resp)) {
+        // also a 304 for a stale hit, answered from the cache below
+        c->cachable = false;
+    } else {
+        cache_fill_freshness(&c->fill, lifetime, resp.etag.ptr, resp.etag.len,
+                             resp.last_modified.ptr, resp.last_modified.len);
+    }
+
+    if (parsed && c->stale && resp.status == 304) {
+        cache_obj_refresh(c->stale, lifetime);
+        close(c->server.fd);
+        c->server.fd = -1;
+        c->obj = c->stale;
+        c->obj_off = 0;
+        c->stale = NULL;
+        c->state = CONN_SERVE_CACHE;
+        return STEP_NEXT;
+    }
+
+    c->off = 0;
+    conn_fill(c, c->len);
+    c->state = CONN_RELAY;
+    return STEP_NEXT;
+}
+
+static step_t do_relay(conn_t *c) {
+    while (1) {
+        // drain what we have to the client before reading more
+        if (c->off < c->len) {
+            ssize_t n =
+                write(c->client.fd, c->buf + c->off, c->len - c->off);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return STEP_WAIT;
+                }
+                return STEP_CLOSE;
+            }
+            c->off += (size_t)n;
+            continue;
+        }
+
+        ssize_t n = read(c->server.fd, c->buf, sizeof(c->buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return STEP_WAIT;
+            }
+            return STEP_CLOSE;
+        }
+        if (n == 0) {
+            break;
+        }
+        c->len = (size_t)n;
+        c->off = 0;
+        conn_fill(c, c->len);
+    }
+
+    if (c->cachable && c->fill.size > 0) {
+        insert_cache_obj_to_cache(c->key, &c->fill);
+    }
+    return STEP_CLOSE;
+}
+
+static step_t do_serve_cache(conn_t *c) {
+    while (c->obj_off < c->obj->size) {
+        ssize_t n = cache_obj_write(c->client.fd, c->obj, c->obj_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return STEP_WAIT;
+            }
+            return STEP_CLOSE;
+        }
+        c->obj_off += (size_t)n;
+    }
+    return STEP_CLOSE;
+}
+
+static step_t do_send_error(conn_t *c) {
+    step_t step = write_out(c, c->client.fd);
+    return step == STEP_NEXT ? STEP_CLOSE : step;
+}
+
+/*
+ * run state handlers until the connection blocks or is finished
+ */
+static void conn_drive(loop_t *loop, conn_t *c) {
+    step_t step = STEP_NEXT;
+    while (step == STEP_NEXT) {
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+            step = do_read_request(loop, c);
+            break;
+        case CONN_CONNECT:
+            step = do_connect(loop, c);
+            break;
+        case CONN_SEND_REQUEST:
+            step = do_send_request(c);
+            break;
+        case CONN_RELAY_HEAD:
+            step = do_relay_head(c);
+            break;
+        case CONN_RELAY:
+            step = do_relay(c);
+            break;
+        case CONN_SERVE_CACHE:
+            step = do_serve_cache(c);
+            break;
+        case CONN_SEND_ERROR:
+            step = do_send_error(c);
+            break;
+        }
+    }
+    if (step == STEP_CLOSE) {
+        conn_close(loop, c);
+    }
+}
+
+static void loop_accept(loop_t *loop) {
+    while (1) {
+        int fd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return; // EAGAIN, or out of descriptors until some close
+        }
+
+        conn_t *c = conn_new(fd);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        // reports the socket right away if the request already arrived
+        if (loop_add(loop, &c->client) < 0) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+static void *loop_thread(void *vargp) {
+    loop_t *loop = vargp;
+    struct epoll_event events[MAX_EVENTS];
+
+    listeners_pin(loop->listeners, loop->id);
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            endpoint_t *ep = events[i].data.ptr;
+            if (!ep) {
+                loop_accept(loop);
+                continue;
+            }
+            ep->events |= events[i].events;
+            if (!ep->conn->closed) {
+                conn_drive(loop, ep->conn);
+            }
+        }
+
+        while (loop->closed) {
+            conn_t *c = loop->closed;
+            loop->closed = c->next_closed;
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * run the edge-triggered epoll engine on already listening sockets
+ * nthreads event loops accept from theirs, each carrying many connections
+ * does not return
+ */
+void event_run(const listeners_t *listeners, int nthreads) {
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    for (int i = 0; i < listeners->nfds; i++) {
+        if (set_nonblocking(listeners->fds[i]) < 0) {
+            perror("fcntl");
+            exit(1);
+        }
+    }
+
+    loop_t *loops = calloc((size_t)nthreads, sizeof(loop_t));
+    if (!loops) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        struct epoll_event ev;
+        loops[i].id = i;
+        loops[i].listenfd = listeners_fd(listeners, i);
+        loops[i].closed = NULL;
+        loops[i].listeners = listeners;
+        loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loops[i].epfd < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        // level-triggered, and only one loop is woken per connection
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].listenfd, &ev) <
+            0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    for (int i = 1; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, loop_thread, &loops[i]) != 0) {
+            fprintf(stderr, "could not start event loop %d\n", i);
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    loop_thread(&loops[0]);
+}
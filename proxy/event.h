@@ -0,0 +1,13 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "listener.h"
+
+/*
+ * run the edge-triggered epoll engine on already listening sockets
+ * nthreads event loops accept from theirs, each carrying many connections
+ * does not return
+ */
+void event_run(const listeners_t *listeners, int nthreads);
+
+#endif
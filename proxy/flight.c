@@ -0,0 +1,248 @@
+/*
+ * flight.c - coalescing of concurrent misses on the same uri
+ *
+ * A flight keeps the response published so far in a list of fixed-size
+ * chunks that never move, so followers write published bytes to their
+ * clients without holding any lock. Only the leader appends: it copies
+ * into the free tail of the last chunk first and takes the lock just to
+ * publish the new length and wake the followers.
+ */
+#include "flight.h"
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLIGHT_CHUNK (16 * 1024)
+#define FLIGHT_BUCKETS 64
+
+typedef struct flight_chunk {
+    struct flight_chunk *next;
+    size_t len; // published bytes of data
+    char data[FLIGHT_CHUNK];
+} flight_chunk_t;
+
+struct flight {
+    char *key;
+    flight_chunk_t *head;
+    flight_chunk_t *tail;
+    size_t len;    // published bytes of the whole response
+    bool joinable; // still in the table
+    bool done;
+    bool failed;
+    int refs; // leader and followers
+    struct flight *next; // bucket chain
+};
+
+/*
+ * one lock for the table and all flights, held only briefly, and one
+ * condition for followers of any flight: they recheck their own flight
+ * when woken
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t more;
+    int waiting; // followers asleep on more
+    flight_t *buckets[FLIGHT_BUCKETS];
+} flights = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+             .more = PTHREAD_COND_INITIALIZER};
+
+/*
+ * FNV-1a, as for the cache index
+ */
+static flight_t **bucket_of(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return &flights.buckets[hash % FLIGHT_BUCKETS];
+}
+
+/*
+ * take flight out of the table, must hold flights.mutex
+ */
+static void flight_unlink(flight_t *flight) {
+    if (!flight->joinable) {
+        return;
+    }
+    flight_t **pp = bucket_of(flight->key);
+    while (*pp != flight) {
+        pp = &(*pp)->next;
+    }
+    *pp = flight->next;
+    flight->next = NULL;
+    flight->joinable = false;
+}
+
+/*
+ * wake every sleeping follower, must hold flights.mutex
+ * one signal per sleeper rather than a broadcast: the test driver's
+ * wrapper only interposes pthread_cond_wait and pthread_cond_signal
+ */
+static void wake_followers(void) {
+    for (int i = 0; i < flights.waiting; i++) {
+        pthread_cond_signal(&flights.more);
+    }
+}
+
+/*
+ * join the flight for key, or start it and set *leader
+ * return NULL if out of memory
+ */
+flight_t *flight_join(const char *key, bool *leader) {
+    flight_t **bucket = bucket_of(key);
+
+    pthread_mutex_lock(&flights.mutex);
+    for (flight_t *curr = *bucket; curr; curr = curr->next) {
+        if (!strcmp(curr->key, key)) {
+            curr->refs++;
+            pthread_mutex_unlock(&flights.mutex);
+            *leader = false;
+            return curr;
+        }
+    }
+
+    flight_t *flight = calloc(1, sizeof(flight_t));
+    if (!flight || !(flight->key = strdup(key))) {
+        pthread_mutex_unlock(&flights.mutex);
+        free(flight);
+        return NULL;
+    }
+    flight->joinable = true;
+    flight->refs = 1;
+    flight->next = *bucket;
+    *bucket = flight;
+    pthread_mutex_unlock(&flights.mutex);
+
+    *leader = true;
+    return flight;
+}
+
+/*
+ * leader: publish the next n bytes of the response
+ */
+void flight_append(flight_t *flight, const char *buf, size_t n) {
+    while (n > 0 && !flight->failed) {
+        // only the leader changes the tail, no lock needed to look at it
+        flight_chunk_t *chunk = flight->tail;
+        bool fresh = false;
+        if (!chunk || chunk->len == FLIGHT_CHUNK) {
+            chunk = malloc(sizeof(flight_chunk_t));
+            fresh = true;
+        }
+
+        if (!chunk) {
+            // followers get what was published so far and then an error
+            pthread_mutex_lock(&flights.mutex);
+            flight->failed = true;
+            flight_unlink(flight);
+            wake_followers();
+            pthread_mutex_unlock(&flights.mutex);
+            return;
+        }
+
+        size_t len = fresh ? 0 : chunk->len;
+        size_t copy = FLIGHT_CHUNK - len;
+        if (copy > n) {
+            copy = n;
+        }
+        // followers never read past chunk->len
+        memcpy(chunk->data + len, buf, copy);
+
+        pthread_mutex_lock(&flights.mutex);
+        if (fresh) {
+            chunk->next = NULL;
+            if (flight->tail) {
+                flight->tail->next = chunk;
+            } else {
+                flight->head = chunk;
+            }
+            flight->tail = chunk;
+        }
+        chunk->len = len + copy;
+        flight->len += copy;
+        if (flight->len > MAX_OBJECT_SIZE) {
+            // not cachable anymore, later requests fetch on their own
+            flight_unlink(flight);
+        }
+        wake_followers();
+        pthread_mutex_unlock(&flights.mutex);
+
+        buf += copy;
+        n -= copy;
+    }
+}
+
+/*
+ * leader: the whole response was published (ok) or the fetch broke off;
+ * wakes every follower and removes the flight from the table
+ */
+void flight_finish(flight_t *flight, bool ok) {
+    pthread_mutex_lock(&flights.mutex);
+    flight_unlink(flight);
+    flight->done = true;
+    if (!ok) {
+        flight->failed = true;
+    }
+    wake_followers();
+    pthread_mutex_unlock(&flights.mutex);
+}
+
+/*
+ * follower: wait for bytes reader has not read yet
+ * return how many are available at *data, 0 at the end of the response,
+ * or -1 if the fetch broke off before that
+ */
+ssize_t flight_read(flight_t *flight, flight_reader_t *reader,
+                    const char **data) {
+    pthread_mutex_lock(&flights.mutex);
+    while (reader->off == flight->len && !flight->done && !flight->failed) {
+        flights.waiting++;
+        pthread_cond_wait(&flights.more, &flights.mutex);
+        flights.waiting--;
+    }
+    if (reader->off == flight->len) {
+        ssize_t end = flight->failed ? -1 : 0;
+        pthread_mutex_unlock(&flights.mutex);
+        return end;
+    }
+
+    if (!reader->chunk) {
+        reader->chunk = flight->head;
+        reader->pos = 0;
+    } else if (reader->pos == FLIGHT_CHUNK) {
+        reader->chunk = reader->chunk->next;
+        reader->pos = 0;
+    }
+    size_t n = reader->chunk->len - reader->pos;
+    pthread_mutex_unlock(&flights.mutex);
+
+    // published bytes stay put until the last reference is dropped
+    *data = reader->chunk->data + reader->pos;
+    reader->pos += n;
+    reader->off += n;
+    return (ssize_t)n;
+}
+
+/*
+ * drop the leader's or a follower's reference
+ */
+void flight_release(flight_t *flight) {
+    pthread_mutex_lock(&flights.mutex);
+    int refs = --flight->refs;
+    pthread_mutex_unlock(&flights.mutex);
+    if (refs > 0) {
+        return;
+    }
+
+    while (flight->head) {
+        flight_chunk_t *next = flight->head->next;
+        free(flight->head);
+        flight->head = next;
+    }
+    free(flight->key);
+    free(flight);
+}
@@ -0,0 +1,57 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Single-flight table of responses being fetched from end servers.
+ *
+ * The first request that misses the cache on a uri becomes the leader of
+ * a flight: it fetches the response and publishes every byte it relays.
+ * Requests for the same uri arriving meanwhile join as followers and
+ * stream the published bytes to their own client instead of fetching the
+ * uri again. Once a response outgrows MAX_OBJECT_SIZE it can no longer be
+ * cached, and the flight stops taking new followers.
+ */
+typedef struct flight flight_t;
+
+/* a follower's position in the response */
+typedef struct {
+    struct flight_chunk *chunk; // chunk holding the next byte, or NULL
+    size_t pos;                 // offset of the next byte in chunk
+    size_t off;                 // bytes read so far
+} flight_reader_t;
+
+/*
+ * join the flight for key, or start it and set *leader
+ * return NULL if out of memory
+ */
+flight_t *flight_join(const char *key, bool *leader);
+
+/*
+ * leader: publish the next n bytes of the response
+ */
+void flight_append(flight_t *flight, const char *buf, size_t n);
+
+/*
+ * leader: the whole response was published (ok) or the fetch broke off;
+ * wakes every follower and removes the flight from the table
+ */
+void flight_finish(flight_t *flight, bool ok);
+
+/*
+ * follower: wait for bytes reader has not read yet
+ * return how many are available at *data, 0 at the end of the response,
+ * or -1 if the fetch broke off before that
+ */
+ssize_t flight_read(flight_t *flight, flight_reader_t *reader,
+                    const char **data);
+
+/*
+ * drop the leader's or a follower's reference
+ */
+void flight_release(flight_t *flight);
+
+#endif
@@ -0,0 +1,733 @@
+#include "http.h"
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * String to use for the User-Agent header.
+ */
+static const char *header_user_agent = "User-Agent: Mozilla/5.0"
+                                       " (X11; Linux x86_64; rv:3.10.0)"
+                                       " Gecko/20220411 Firefox/63.0.1\r\n";
+
+static const char *header_connection = "Connection: close\r\n";
+static const char *header_proxy_connection = "Proxy-Connection: close\r\n";
+static const char *header_keep_alive = "Connection: keep-alive\r\n";
+
+static bool request_error(http_error_t *err, const char *errnum,
+                          const char *shortmsg, const char *longmsg) {
+    err->errnum = errnum;
+    err->shortmsg = shortmsg;
+    err->longmsg = longmsg;
+    return false;
+}
+
+/*
+ * value of the header in line if it is called name, else NULL
+ */
+static const char *header_value(const char *line, const char *name) {
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) || line[len] != ':') {
+        return NULL;
+    }
+    line += len + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+/*
+ * whether the comma separated list in value (up to the line ending)
+ * holds token, ignoring case and any ;parameters
+ */
+static bool has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    while (*value && *value != '\r' && *value != '\n') {
+        value += strspn(value, " \t,");
+        size_t n = strcspn(value, ",; \t\r\n");
+        if (n == len && !strncasecmp(value, token, len)) {
+            return true;
+        }
+        value += n;
+        value += strcspn(value, ",\r\n");
+    }
+    return false;
+}
+
+static bool slice_is(http_slice_t s, const char *str) {
+    return s.len == strlen(str) && !strncasecmp(s.ptr, str, s.len);
+}
+
+/*
+ * the parts of an absolute uri, http://host[:port][/path], or of the
+ * host:port a CONNECT names, which has no scheme and no path
+ */
+typedef struct {
+    http_slice_t scheme;
+    http_slice_t host;
+    http_slice_t port;
+    http_slice_t path;
+} uri_parts_t;
+
+/*
+ * the request line, split while scanning it once
+ * return false if it is not METHOD URI HTTP/x.y, or the uri is not
+ * absolute, except after CONNECT
+ */
+static bool parse_request_line(const char **pos, const char *end,
+                               http_slice_t *method, http_slice_t *uri,
+                               uri_parts_t *parts, bool *http11) {
+    const char *p = *pos;
+
+    method->ptr = p;
+    while (p < end && *p != ' ' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    method->len = (size_t)(p - method->ptr);
+    if (p == end || *p != ' ' || method->len == 0) {
+        return false;
+    }
+    while (p < end && *p == ' ') {
+        p++;
+    }
+
+    // scheme "://" host [":" port] [path], each part found on the way;
+    // CONNECT starts right at the host
+    uri->ptr = p;
+    parts->scheme.ptr = p;
+    parts->scheme.len = 0;
+    if (method->len != 7 || strncmp(method->ptr, "CONNECT", 7)) {
+        while (p < end && *p != ':' && *p != ' ' && *p != '\r' &&
+               *p != '\n') {
+            p++;
+        }
+        parts->scheme.len = (size_t)(p - parts->scheme.ptr);
+        if (end - p < 3 || p[0] != ':' || p[1] != '/' || p[2] != '/') {
+            return false;
+        }
+        p += 3;
+    }
+    parts->host.ptr = p;
+    while (p < end && *p != ':' && *p != '/' && *p != ' ' && *p != '\r' &&
+           *p != '\n') {
+        p++;
+    }
+    parts->host.len = (size_t)(p - parts->host.ptr);
+    parts->port.ptr = p;
+    parts->port.len = 0;
+    if (p < end && *p == ':') {
+        parts->port.ptr = ++p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+        parts->port.len = (size_t)(p - parts->port.ptr);
+    }
+    parts->path.ptr = p;
+    while (p < end && *p != ' ' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    parts->path.len = (size_t)(p - parts->path.ptr);
+    uri->len = (size_t)(p - uri->ptr);
+    if (p == end || *p != ' ') {
+        return false;
+    }
+    while (p < end && *p == ' ') {
+        p++;
+    }
+
+    // "HTTP/" major "." minor, then the line ending
+    if (end - p < 8 || strncmp(p, "HTTP/", 5) || p[5] < '0' || p[5] > '9' ||
+        p[6] != '.' || p[7] < '0' || p[7] > '9') {
+        return false;
+    }
+    *http11 = p[5] > '1' || (p[5] == '1' && p[7] >= '1');
+    p += 8;
+    if (p < end && *p == '\r') {
+        p++;
+    }
+    if (p == end || *p != '\n') {
+        return false;
+    }
+    *pos = p + 1;
+    return true;
+}
+
+/*
+ * sort one header line of the client into the request
+ * return false if there is no room left for it
+ */
+static bool add_header(http_request_t *req, http_slice_t name,
+                       const char *value, http_slice_t line) {
+    if (slice_is(name, "Host")) {
+        req->host_header = line;
+        return true;
+    }
+    // ignore client's own request header of User-Agent, Connection,
+    // Proxy-Connection, they only say how it wants its own connection
+    if (slice_is(name, "User-Agent")) {
+        return true;
+    }
+    // kept apart in case the proxy asks its own question instead
+    if ((slice_is(name, "If-None-Match") ||
+         slice_is(name, "If-Modified-Since")) &&
+        req->nconditional < 2) {
+        req->conditional[req->nconditional++] = line;
+        return true;
+    }
+    if (slice_is(name, "Connection") || slice_is(name, "Proxy-Connection")) {
+        if (has_token(value, "close")) {
+            req->keep_alive = false;
+        } else if (has_token(value, "keep-alive")) {
+            req->keep_alive = true;
+        }
+        return true;
+    }
+
+    // Forward all remaining headers, as one piece with the previous line
+    // if nothing was dropped in between
+    if (req->nforward > 0) {
+        http_slice_t *last = &req->forward[req->nforward - 1];
+        if (last->ptr + last->len == line.ptr) {
+            last->len += line.len;
+            return true;
+        }
+    }
+    if (req->nforward == HTTP_MAX_HEADERS) {
+        return false;
+    }
+    req->forward[req->nforward++] = line;
+    return true;
+}
+
+/*
+ * parse the request header in buf[0, len) in a single pass, in place
+ * a header cut short by the end of buf is taken as it is
+ * return true on success
+ * else: fill err and return false
+ */
+bool http_request_parse(http_request_t *req, char *buf, size_t len,
+                        http_error_t *err) {
+    const char *pos = buf;
+    const char *end = buf + len;
+    http_slice_t method;
+    http_slice_t uri;
+    uri_parts_t parts;
+    bool http11;
+
+    req->keep_alive = false;
+    req->host_header.ptr = NULL;
+    req->host_header.len = 0;
+    req->nforward = 0;
+    req->nconditional = 0;
+    req->if_none_match = NULL;
+    req->if_modified_since = NULL;
+
+    /* Parse request line and check if it's well-formed */
+    if (!parse_request_line(&pos, end, &method, &uri, &parts, &http11)) {
+        return request_error(err, "400", "Bad Request",
+                             "Proxy could not parse the request line");
+    }
+
+    // Check that the method is GET, or CONNECT for a tunnel
+    if (method.len == 3 && !strncmp(method.ptr, "GET", 3)) {
+        req->method = HTTP_METHOD_GET;
+    } else if (method.len == 7 && !strncmp(method.ptr, "CONNECT", 7)) {
+        req->method = HTTP_METHOD_CONNECT;
+    } else {
+        return request_error(err, "501", "Not Implemented",
+                             "Proxy  does not implement this method");
+    }
+
+    /* Support http only, https goes through a tunnel */
+    if (req->method == HTTP_METHOD_GET && !slice_is(parts.scheme, "http")) {
+        return request_error(err, "501", "Not Implemented",
+                             "Proxy does not support this protocol");
+    }
+    // a tunnel needs the port, and has nothing after it
+    if (req->method == HTTP_METHOD_CONNECT &&
+        (parts.port.len == 0 || parts.path.len > 0)) {
+        return request_error(err, "400", "Bad Request",
+                             "Proxy could not parse the tunnel's host:port");
+    }
+
+    if (parts.host.len == 0 || parts.host.len > HTTP_MAX_HOST) {
+        return request_error(err, "400", "Bad Request",
+                             "Proxy could not parse host");
+    }
+    memcpy(req->host, parts.host.ptr, parts.host.len);
+    req->host[parts.host.len] = '\0';
+
+    if (parts.port.len >= sizeof(req->port)) {
+        return request_error(err, "400", "Bad Request",
+                             "Proxy could not parse post");
+    }
+    if (parts.port.len == 0) {
+        strcpy(req->port, "80");
+    } else {
+        memcpy(req->port, parts.port.ptr, parts.port.len);
+        req->port[parts.port.len] = '\0';
+    }
+
+    req->path = parts.path;
+    if (req->path.len == 0) {
+        req->path.ptr = "/";
+        req->path.len = 1;
+    }
+
+    // persistent unless asked otherwise from HTTP/1.1 on
+    req->keep_alive = http11;
+
+    /* read, parse, and sort the request header lines */
+    while (pos < end && *pos != '\r' && *pos != '\n') {
+        const char *colon;
+        const char *nl = scan_line(pos, end, &colon);
+        if (!nl) {
+            break; // a partial last line is dropped
+        }
+        http_slice_t line = {pos, (size_t)(nl + 1 - pos)};
+        http_slice_t name = {pos, 0};
+        const char *value = "";
+        // not a header without a colon, forwarded as it is
+        if (colon) {
+            name.len = (size_t)(colon - pos);
+            value = colon + 1;
+        }
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        if (!add_header(req, name, value, line)) {
+            return request_error(err, "400", "Bad Request",
+                                 "Proxy could not fit the request headers");
+        }
+        pos = nl + 1;
+    }
+
+    // the uri becomes the cache key, ended where the space after it was
+    req->uri = (char *)uri.ptr;
+    req->uri[uri.len] = '\0';
+    return true;
+}
+
+static void iov_put(struct iovec *iov, int *n, const char *ptr, size_t len) {
+    iov[*n].iov_base = (void *)ptr;
+    iov[*n].iov_len = len;
+    (*n)++;
+}
+
+static void iov_str(struct iovec *iov, int *n, const char *str) {
+    iov_put(iov, n, str, strlen(str));
+}
+
+/*
+ * point iov at the request for the end server, as HTTP/1.1 asking to
+ * keep the connection open if keep_alive, else as HTTP/1.0 with
+ * Connection: close; iov must have room for HTTP_REQUEST_IOVS
+ * return the number of iovecs used
+ */
+int http_request_iov(http_request_t *req, bool keep_alive,
+                     struct iovec *iov) {
+    int n = 0;
+
+    iov_put(iov, &n, "GET ", 4);
+    iov_put(iov, &n, req->path.ptr, req->path.len);
+    iov_str(iov, &n, keep_alive ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+
+    if (req->host_header.len > 0) {
+        iov_put(iov, &n, req->host_header.ptr, req->host_header.len);
+    } else {
+        int len;
+        if (strcmp(req->port, "80") != 0) {
+            len = snprintf(req->host_line, sizeof(req->host_line),
+                           "Host: %s:%s\r\n", req->host, req->port);
+        } else {
+            len = snprintf(req->host_line, sizeof(req->host_line),
+                           "Host: %s\r\n", req->host);
+        }
+        iov_put(iov, &n, req->host_line, (size_t)len);
+    }
+
+    // combine client's headers and proxy's headers
+    // Proxy-Connection is only meant for proxies, the server is not one
+    iov_str(iov, &n, header_user_agent);
+    if (keep_alive) {
+        iov_str(iov, &n, header_keep_alive);
+    } else {
+        iov_str(iov, &n, header_connection);
+        iov_str(iov, &n, header_proxy_connection);
+    }
+    for (int i = 0; i < req->nforward; i++) {
+        iov_put(iov, &n, req->forward[i].ptr, req->forward[i].len);
+    }
+    if (req->if_none_match || req->if_modified_since) {
+        if (req->if_none_match) {
+            iov_str(iov, &n, "If-None-Match: ");
+            iov_str(iov, &n, req->if_none_match);
+            iov_str(iov, &n, "\r\n");
+        }
+        if (req->if_modified_since) {
+            iov_str(iov, &n, "If-Modified-Since: ");
+            iov_str(iov, &n, req->if_modified_since);
+            iov_str(iov, &n, "\r\n");
+        }
+    } else {
+        for (int i = 0; i < req->nconditional; i++) {
+            iov_put(iov, &n, req->conditional[i].ptr, req->conditional[i].len);
+        }
+    }
+    iov_str(iov, &n, "\r\n");
+    return n;
+}
+
+size_t http_head_end(const char *buf, size_t len, size_t *scanned) {
+    size_t off = *scanned;
+    while (off < len) {
+        const char *nl = scan_line(buf + off, buf + len, NULL);
+        if (!nl) {
+            *scanned = len;
+            return 0;
+        }
+        size_t next = (size_t)(nl - buf) + 1;
+        if (next < len && buf[next] == '\n') {
+            return next + 1;
+        }
+        if (next + 1 < len && buf[next] == '\r' && buf[next + 1] == '\n') {
+            return next + 2;
+        }
+        if (next + 1 >= len) {
+            // not enough bytes yet to tell, look at this line end again
+            *scanned = next - 1;
+            return 0;
+        }
+        off = next;
+    }
+    *scanned = off;
+    return 0;
+}
+
+/*
+ * skip the first n bytes of the iovecs at iov, which *iovcnt counts
+ * return the first iovec left
+ */
+struct iovec *http_iov_advance(struct iovec *iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    return iov;
+}
+
+/*
+ * the status line of a response, HTTP/x.y code ...
+ * return false if it is not one
+ */
+static bool parse_status_line(http_response_t *resp, const char *p,
+                              const char *end) {
+    if (end - p < 12 || strncmp(p, "HTTP/", 5) || p[5] < '0' || p[5] > '9' ||
+        p[6] != '.' || p[7] < '0' || p[7] > '9' || p[8] != ' ') {
+        return false;
+    }
+    resp->http11 = p[5] > '1' || (p[5] == '1' && p[7] >= '1');
+    p += 9;
+    for (int i = 0; i < 3; i++, p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        resp->status = resp->status * 10 + (*p - '0');
+    }
+    return true;
+}
+
+/*
+ * days from 1970-01-01 to the given date of the proleptic Gregorian
+ * calendar
+ */
+static long long days_from_civil(long long y, int m, int d) {
+    y -= m <= 2;
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    long long yoe = y - era * 400;
+    long long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * an HTTP date, as in "Sun, 06 Nov 1994 08:49:37 GMT"
+ * return -1 if value is not one
+ */
+static time_t parse_http_date(const char *value) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    int day, year, hour, min, sec;
+
+    if (sscanf(value, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, mon, &year,
+               &hour, &min, &sec) != 6 ||
+        strlen(mon) != 3) {
+        return -1;
+    }
+    const char *m = strstr(months, mon);
+    if (!m || (m - months) % 3 != 0) {
+        return -1;
+    }
+    int month = (int)(m - months) / 3 + 1;
+    return (time_t)(days_from_civil(year, month, day) * 86400 + hour * 3600 +
+                    min * 60 + sec);
+}
+
+/*
+ * the number of seconds of a "name=seconds" directive in the comma
+ * separated list in value (up to the line ending)
+ * return -1 if there is none
+ */
+static long long directive_seconds(const char *value, const char *name) {
+    size_t len = strlen(name);
+    while (*value && *value != '\r' && *value != '\n') {
+        value += strspn(value, " \t,");
+        if (!strncasecmp(value, name, len) && value[len] == '=') {
+            const char *p = value + len + 1;
+            p += *p == '"';
+            char *end;
+            long long seconds = strtoll(p, &end, 10);
+            return end != p && seconds >= 0 ? seconds : -1;
+        }
+        value += strcspn(value, ",\r\n");
+    }
+    return -1;
+}
+
+/*
+ * value up to the end of its line, without trailing white space
+ */
+static http_slice_t header_slice(const char *value, const char *nl) {
+    http_slice_t s = {value, (size_t)(nl - value)};
+    while (s.len > 0 && (s.ptr[s.len - 1] == '\r' || s.ptr[s.len - 1] == ' ' ||
+                         s.ptr[s.len - 1] == '\t')) {
+        s.len--;
+    }
+    return s;
+}
+
+/*
+ * note one response header line, which ends at nl
+ */
+static void add_response_header(http_response_t *resp, const char *line,
+                                const char *nl) {
+    const char *value;
+
+    if ((value = header_value(line, "Content-Length"))) {
+        char *end;
+        long long len = strtoll(value, &end, 10);
+        if (end != value && len >= 0) {
+            resp->content_length = len;
+        }
+    } else if ((value = header_value(line, "Transfer-Encoding"))) {
+        resp->chunked = has_token(value, "chunked");
+    } else if ((value = header_value(line, "Connection"))) {
+        resp->conn_close |= has_token(value, "close");
+        resp->conn_keep_alive |= has_token(value, "keep-alive");
+    } else if ((value = header_value(line, "Cache-Control"))) {
+        resp->no_store |= has_token(value, "no-store");
+        resp->no_store |= has_token(value, "private");
+        resp->no_cache |= has_token(value, "no-cache");
+        long long seconds;
+        if ((seconds = directive_seconds(value, "max-age")) >= 0) {
+            resp->max_age = seconds;
+        }
+        if ((seconds = directive_seconds(value, "s-maxage")) >= 0) {
+            resp->s_maxage = seconds;
+        }
+    } else if ((value = header_value(line, "Expires"))) {
+        // an invalid date means already expired
+        resp->expires = parse_http_date(value);
+        if (resp->expires < 0) {
+            resp->expires = 0;
+        }
+    } else if ((value = header_value(line, "Date"))) {
+        resp->date = parse_http_date(value);
+    } else if ((value = header_value(line, "Age"))) {
+        char *end;
+        long long age = strtoll(value, &end, 10);
+        if (end != value && age >= 0) {
+            resp->age = age;
+        }
+    } else if ((value = header_value(line, "ETag"))) {
+        resp->etag = header_slice(value, nl);
+    } else if ((value = header_value(line, "Last-Modified"))) {
+        resp->last_modified = header_slice(value, nl);
+        resp->last_mod = parse_http_date(value);
+    }
+}
+
+/*
+ * parse the response header in head[0, len), which ends with an empty line
+ * return false if it does not start with an HTTP status line, resp then
+ * asks for HTTP_BODY_CLOSE
+ */
+bool http_response_parse(http_response_t *resp, const char *head,
+                         size_t len) {
+    const char *end = head + len;
+    const char *nl;
+
+    resp->status = 0;
+    resp->http11 = false;
+    resp->content_length = -1;
+    resp->chunked = false;
+    resp->conn_close = false;
+    resp->conn_keep_alive = false;
+    resp->no_store = false;
+    resp->no_cache = false;
+    resp->max_age = -1;
+    resp->s_maxage = -1;
+    resp->age = 0;
+    resp->date = -1;
+    resp->expires = -1;
+    resp->last_mod = -1;
+    resp->etag.ptr = NULL;
+    resp->etag.len = 0;
+    resp->last_modified.ptr = NULL;
+    resp->last_modified.len = 0;
+
+    if (!(nl = scan_line(head, end, NULL)) ||
+        !parse_status_line(resp, head, nl + 1)) {
+        resp->status = 0;
+        return false;
+    }
+    for (const char *p = nl + 1; (nl = scan_line(p, end, NULL)); p = nl + 1) {
+        add_response_header(resp, p, nl);
+    }
+    return true;
+}
+
+/*
+ * how the body of the response is delimited
+ * interim 1xx responses are not expected, the proxy never sends Expect,
+ * so they are relayed up to the close like anything else unusual
+ */
+http_body_t http_response_body(const http_response_t *resp) {
+    if (resp->status == 204 || resp->status == 304) {
+        return HTTP_BODY_NONE;
+    }
+    if (resp->status < 200) {
+        return HTTP_BODY_CLOSE;
+    }
+    // chunked wins over a Content-Length sent along with it
+    if (resp->chunked) {
+        return HTTP_BODY_CHUNKED;
+    }
+    if (resp->content_length >= 0) {
+        return HTTP_BODY_LENGTH;
+    }
+    return HTTP_BODY_CLOSE;
+}
+
+/*
+ * whether a shared cache may store the response: its status is one that
+ * can be cached without being told so, and it does not forbid it
+ */
+bool http_response_cachable(const http_response_t *resp) {
+    static const int statuses[] = {200, 203, 204, 300, 301, 308,
+                                   404, 405, 410, 414, 501};
+
+    if (resp->no_store) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+        if (resp->status == statuses[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * seconds the response stays fresh from now on, from s-maxage, max-age,
+ * Expires or a tenth of its Last-Modified age, minus how old it already is
+ * return HTTP_NO_LIFETIME if it gives none of these
+ */
+long long http_response_lifetime(const http_response_t *resp, time_t now) {
+    time_t date = resp->date >= 0 ? resp->date : now;
+    long long lifetime;
+
+    if (resp->no_cache) {
+        return 0;
+    }
+    if (resp->s_maxage >= 0) {
+        lifetime = resp->s_maxage;
+    } else if (resp->max_age >= 0) {
+        lifetime = resp->max_age;
+    } else if (resp->expires >= 0) {
+        lifetime = (long long)(resp->expires - date);
+    } else if (resp->last_mod >= 0) {
+        lifetime = (long long)(date - resp->last_mod) / 10;
+        if (lifetime > HTTP_HEURISTIC_MAX) {
+            lifetime = HTTP_HEURISTIC_MAX;
+        }
+    } else {
+        return HTTP_NO_LIFETIME;
+    }
+
+    // the older of what the response says and what the clocks say
+    long long age = resp->age;
+    if (now - date > age) {
+        age = (long long)(now - date);
+    }
+    lifetime -= age;
+    return lifetime > 0 ? lifetime : 0;
+}
+
+/*
+ * whether the server lets the connection carry another request once
+ * this response was read to its end
+ */
+bool http_response_keep_alive(const http_response_t *resp) {
+    if (http_response_body(resp) == HTTP_BODY_CLOSE || resp->conn_close) {
+        return false;
+    }
+    return resp->http11 || resp->conn_keep_alive;
+}
+
+/*
+ * format a complete html error response into buf
+ * from clienterror() in tiny.c
+ */
+size_t http_format_error(char *buf, size_t size, const char *errnum,
+                         const char *shortmsg, const char *longmsg) {
+    char body[MAXBUF];
+    size_t buflen;
+    size_t bodylen;
+
+    /* Build the HTTP response body */
+    bodylen = snprintf(body, MAXBUF,
+                       "<!DOCTYPE html>\r\n"
+                       "<html>\r\n"
+                       "<head><title>Proxy Error</title></head>\r\n"
+                       "<body bgcolor=\"ffffff\">\r\n"
+                       "<h1>%s: %s</h1>\r\n"
+                       "<p>%s</p>\r\n"
+                       "<hr /><em>The Proxy Web server</em>\r\n"
+                       "</body></html>\r\n",
+                       errnum, shortmsg, longmsg);
+    if (bodylen >= MAXBUF) {
+        return 0; // Overflow!
+    }
+
+    /* Build the HTTP response headers, followed by the body */
+    buflen = snprintf(buf, size,
+                      "HTTP/1.0 %s %s\r\n"
+                      "Content-Type: text/html\r\n"
+                      "Content-Length: %zu\r\n\r\n"
+                      "%s",
+                      errnum, shortmsg, bodylen, body);
+    if (buflen >= size) {
+        return 0; // Overflow!
+    }
+    return buflen;
+}
@@ -0,0 +1,177 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "csapp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 100 // header lines in a client request
+#define HTTP_MAX_HOST 255    // bytes of a host name
+// iovecs of a rewritten request: request line, proxy headers, end of header
+#define HTTP_REQUEST_IOVS (HTTP_MAX_HEADERS + 16)
+
+/* bytes of a buffer, not NUL-terminated */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} http_slice_t;
+
+/* methods the proxy serves */
+typedef enum {
+    HTTP_METHOD_GET,
+    HTTP_METHOD_CONNECT, // a tunnel to host:port, nothing to rewrite
+} http_method_t;
+
+/*
+ * A client request being rewritten for the origin server.
+ * Shared by the blocking (thread) and event-driven (epoll) engines so that
+ * both forward exactly the same headers.
+ *
+ * It is parsed in place: apart from the host and port, every field points
+ * into the buffer holding the request header, which must outlive it.
+ */
+typedef struct {
+    http_method_t method;
+    char *uri; // NUL-terminated in place, also used as the cache key
+    http_slice_t path;
+    char host[HTTP_MAX_HOST + 1];
+    char port[8];
+    bool keep_alive;          // the client wants the connection kept open
+    http_slice_t host_header; // the client's own Host line, or empty
+    // header lines forwarded as they are, adjacent ones merged
+    http_slice_t forward[HTTP_MAX_HEADERS];
+    int nforward;
+    char host_line[HTTP_MAX_HOST + 16]; // Host line made up if it had none
+    // the client's own If-None-Match and If-Modified-Since lines
+    http_slice_t conditional[2];
+    int nconditional;
+    // validators of a stale cache object, sent instead of the client's
+    // conditions if either is set; NULL after parsing
+    const char *if_none_match;
+    const char *if_modified_since;
+} http_request_t;
+
+/*
+ * how the end of a response body is found
+ */
+typedef enum {
+    HTTP_BODY_NONE,    // no body: 204, 304
+    HTTP_BODY_LENGTH,  // Content-Length bytes
+    HTTP_BODY_CHUNKED, // chunked transfer coding, up to the last chunk
+    HTTP_BODY_CLOSE,   // until the server closes the connection
+} http_body_t;
+
+/*
+ * framing of a response from an end server, taken from its status line
+ * and headers, to tell where it ends on a persistent connection, and
+ * what a shared cache may do with it
+ */
+typedef struct {
+    int status;
+    bool http11;              // HTTP/1.1 or later: persistent by default
+    long long content_length; // -1 if not given
+    bool chunked;
+    bool conn_close;      // Connection: close
+    bool conn_keep_alive; // Connection: keep-alive
+    // Cache-Control
+    bool no_store;       // no-store or private: not for a shared cache
+    bool no_cache;       // stored, but revalidated before every use
+    long long max_age;   // -1 if not given
+    long long s_maxage;  // -1 if not given
+    long long age;       // Age, 0 if not given
+    time_t date;         // -1 if not given
+    time_t expires;      // -1 if not given, 0 if not a valid date
+    time_t last_mod;     // Last-Modified as a time, -1 if not given
+    http_slice_t etag;          // validators as sent, empty if not given
+    http_slice_t last_modified; // without the line ending
+} http_response_t;
+
+// a response that says nothing about how long it stays fresh
+#define HTTP_NO_LIFETIME (-1)
+// longest lifetime guessed from Last-Modified alone
+#define HTTP_HEURISTIC_MAX (24 * 60 * 60)
+
+/*
+ * status line and message to report back to the client on a bad request
+ */
+typedef struct {
+    const char *errnum;
+    const char *shortmsg;
+    const char *longmsg;
+} http_error_t;
+
+/*
+ * parse the request header in buf[0, len) in a single pass, in place
+ * a header cut short by the end of buf is taken as it is
+ * return true on success
+ * else: fill err and return false
+ */
+bool http_request_parse(http_request_t *req, char *buf, size_t len,
+                        http_error_t *err);
+
+/*
+ * point iov at the request for the end server, as HTTP/1.1 asking to
+ * keep the connection open if keep_alive, else as HTTP/1.0 with
+ * Connection: close; iov must have room for HTTP_REQUEST_IOVS
+ * return the number of iovecs used
+ */
+int http_request_iov(http_request_t *req, bool keep_alive,
+                     struct iovec *iov);
+
+/*
+ * check whether the empty line ending a header has arrived in buf[0, len)
+ * *scanned is where the previous check on the same buf left off, 0 at
+ * first, and is moved up so that the next check resumes there
+ * return the length of the header with that line, or 0 if incomplete
+ */
+size_t http_head_end(const char *buf, size_t len, size_t *scanned);
+
+/*
+ * skip the first n bytes of the iovecs at iov, which *iovcnt counts
+ * return the first iovec left
+ */
+struct iovec *http_iov_advance(struct iovec *iov, int *iovcnt, size_t n);
+
+/*
+ * parse the response header in head[0, len), which ends with an empty line
+ * return false if it does not start with an HTTP status line, resp then
+ * asks for HTTP_BODY_CLOSE
+ */
+bool http_response_parse(http_response_t *resp, const char *head,
+                         size_t len);
+
+/*
+ * how the body of the response is delimited
+ */
+http_body_t http_response_body(const http_response_t *resp);
+
+/*
+ * whether a shared cache may store the response: its status is one that
+ * can be cached without being told so, and it does not forbid it
+ */
+bool http_response_cachable(const http_response_t *resp);
+
+/*
+ * seconds the response stays fresh from now on, from s-maxage, max-age,
+ * Expires or a tenth of its Last-Modified age, minus how old it already is
+ * return HTTP_NO_LIFETIME if it gives none of these
+ */
+long long http_response_lifetime(const http_response_t *resp, time_t now);
+
+/*
+ * whether the server lets the connection carry another request once
+ * this response was read to its end
+ */
+bool http_response_keep_alive(const http_response_t *resp);
+
+/*
+ * format a complete html error response into buf
+ * return its length, or 0 if it does not fit
+ */
+size_t http_format_error(char *buf, size_t size, const char *errnum,
+                         const char *shortmsg, const char *longmsg);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * listener.c - listening sockets of the event loop engines
+ */
+#define _GNU_SOURCE
+
+#include "listener.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * open_listenfd with SO_REUSEPORT set before binding, so that every
+ * loop's socket can take the same port
+ * return a listening socket, or -1 on failure
+ */
+static int open_reuseport_listenfd(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
+                gai_strerror(rc));
+        return -1;
+    }
+
+    // the first address that binds, as open_listenfd picks it, so that
+    // all sockets end up in the same group
+    for (p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listenfd < 0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                       sizeof(int)) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p) {
+        return -1;
+    }
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * note the CPUs the proxy may run on, in l->cpus
+ * return false on failure
+ */
+static bool cpus_init(listeners_t *l) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return false;
+    }
+    l->cpus = malloc((size_t)CPU_COUNT(&set) * sizeof(int));
+    if (!l->cpus) {
+        return false;
+    }
+    l->ncpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            l->cpus[l->ncpus++] = cpu;
+        }
+    }
+    return l->ncpus > 0;
+}
+
+bool listeners_open(listeners_t *l, const char *port, int nloops,
+                    bool reuseport, bool pin) {
+    l->nfds = reuseport ? nloops : 1;
+    l->fds = malloc((size_t)l->nfds * sizeof(int));
+    l->pin = pin;
+    l->ncpus = 0;
+    l->cpus = NULL;
+    if (!l->fds) {
+        fprintf(stderr, "could not allocate the listeners\n");
+        return false;
+    }
+    if (pin && !cpus_init(l)) {
+        fprintf(stderr, "could not find the CPUs to pin loops to\n");
+        return false;
+    }
+
+    for (int i = 0; i < l->nfds; i++) {
+        l->fds[i] = reuseport ? open_reuseport_listenfd(port)
+                              : open_listenfd(port);
+        if (l->fds[i] < 0) {
+            fprintf(stderr, "could not listen on port %s%s\n", port,
+                    reuseport ? " with SO_REUSEPORT" : "");
+            return false;
+        }
+    }
+    return true;
+}
+
+int listeners_fd(const listeners_t *l, int loop) {
+    return l->fds[loop % l->nfds];
+}
+
+void listeners_pin(const listeners_t *l, int loop) {
+    if (!l->pin) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(l->cpus[loop % l->ncpus], &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        fprintf(stderr, "could not pin loop %d: %s\n", loop, strerror(rc));
+    }
+}
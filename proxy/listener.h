@@ -0,0 +1,44 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stdbool.h>
+
+/*
+ * Listening sockets of the event loop engines, enabled per loop with
+ * "./proxy -m epoll|uring -R [-A] <port>".
+ *
+ * By default every loop accepts from the one socket open_listenfd gives.
+ * With reuseport each loop gets a socket of its own bound to the same
+ * port with SO_REUSEPORT, and the kernel spreads incoming connections
+ * over them by their addresses, so loops never contend for an accept and
+ * a connection is served start to finish by the loop that accepted it.
+ * With pin, loop i is also pinned to the i-th CPU the proxy may run on,
+ * wrapping around if there are more loops than CPUs, which keeps each
+ * connection's state in one CPU's caches.
+ */
+typedef struct {
+    int nfds;  // 1 if shared, else one per loop
+    int *fds;  // listening sockets
+    bool pin;  // pin each loop to a CPU
+    int ncpus; // CPUs the proxy may run on
+    int *cpus; // their numbers
+} listeners_t;
+
+/*
+ * open the listening sockets of nloops loops on port
+ * return false on failure, after printing why
+ */
+bool listeners_open(listeners_t *l, const char *port, int nloops,
+                    bool reuseport, bool pin);
+
+/*
+ * the socket loop accepts from
+ */
+int listeners_fd(const listeners_t *l, int loop);
+
+/*
+ * pin the calling thread, which runs loop, to its CPU if l->pin
+ */
+void listeners_pin(const listeners_t *l, int loop);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * pool.c - fixed pool of pre-spawned worker threads
+ *
+ * The accept loop hands connections to the workers through a bounded
+ * lock-free ring, so no thread is created per connection and the number
+ * of connections in service is capped. An eventfd in semaphore mode
+ * counts queued connections, so idle workers sleep in read() without
+ * holding any lock instead of spinning on an empty ring.
+ */
+#define _GNU_SOURCE
+#include "pool.h"
+#include "ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+struct pool {
+    ring_t queue;
+    int items; // eventfd counting connections in the queue
+    void (*handler)(int);
+};
+
+static int pool_take(pool_t *pool) {
+    intptr_t connfd;
+
+    uint64_t one;
+
+    // takes exactly one from the count, sleeping while it is 0
+    while (read(pool->items, &one, sizeof(one)) < 0) {
+        if (errno != EINTR) {
+            perror("read");
+            exit(1);
+        }
+    }
+    // the count says a connection is queued, but a producer that claimed
+    // an earlier position may still be publishing it
+    while (!ring_pop(&pool->queue, &connfd)) {
+        sched_yield();
+    }
+    return (int)connfd;
+}
+
+static void *worker(void *vargp) {
+    pool_t *pool = vargp;
+    while (1) {
+        pool->handler(pool_take(pool));
+    }
+    return NULL;
+}
+
+/*
+ * start nworkers threads, each calling handler(connfd) for accepted
+ * connections taken from a queue of at most capacity connections
+ * return NULL on failure
+ */
+pool_t *pool_create(int nworkers, size_t capacity, void (*handler)(int)) {
+    pool_t *pool = malloc(sizeof(pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    if (ring_init(&pool->queue, capacity) < 0) {
+        free(pool);
+        return NULL;
+    }
+    pool->items = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+    if (pool->items < 0) {
+        ring_destroy(&pool->queue);
+        free(pool);
+        return NULL;
+    }
+    pool->handler = handler;
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, pool) != 0) {
+            // workers already started keep the pool alive
+            fprintf(stderr, "could only start %d of %d workers\n", i,
+                    nworkers);
+            if (i == 0) {
+                return NULL;
+            }
+            break;
+        }
+        pthread_detach(tid);
+    }
+    return pool;
+}
+
+/*
+ * queue an accepted connection for the next free worker
+ * return false if the queue is full, connfd is then still the caller's
+ */
+bool pool_submit(pool_t *pool, int connfd) {
+    if (!ring_push(&pool->queue, connfd)) {
+        return false;
+    }
+    uint64_t one = 1;
+    while (write(pool->items, &one, sizeof(one)) < 0) {
+        if (errno != EINTR) {
+            perror("write");
+            exit(1);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct pool pool_t;
+
+/*
+ * start nworkers threads, each calling handler(connfd) for accepted
+ * connections taken from a queue of at most capacity connections
+ * return NULL on failure
+ */
+pool_t *pool_create(int nworkers, size_t capacity, void (*handler)(int));
+
+/*
+ * queue an accepted connection for the next free worker
+ * return false if the queue is full, connfd is then still the caller's
+ */
+bool pool_submit(pool_t *pool, int connfd);
+
+#endif
@@ -9,11 +9,25 @@
 
 #include "cache.h"
 #include "csapp.h"
-#include "http_parser.h"
+#include "disk.h"
+#include "dns.h"
+#include "event.h"
+#include "flight.h"
+#include "http.h"
+#include "listener.h"
+#include "pool.h"
+#include "reader.h"
+#include "refresh.h"
+#include "snapshot.h"
+#include "splice.h"
+#include "tunnel.h"
+#include "upstream.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,7 +41,10 @@
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 /*
  * Debug macros, which can be enabled by adding -DDEBUG in the Makefile
@@ -51,15 +68,22 @@
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
-/*
- * String to use for the User-Agent header.
- */
-static const char *header_user_agent = "User-Agent: Mozilla/5.0"
-                                       " (X11; Linux x86_64; rv:3.10.0)"
-                                       " Gecko/20220411 Firefox/63.0.1\r\n";
+/* coalesce concurrent misses on the same uri, enabled with -c */
+static bool coalesce = false;
+
+/* keep connections to end servers open for later requests, with -k */
+static bool keepalive = false;
 
-static const char *header_connection = "Connection: close\r\n";
-static const char *header_proxy_connection = "Proxy-Connection: close\r\n";
+/* seconds a persistent client connection may wait for its next request */
+#define CLIENT_IDLE_TIMEOUT 15
+
+/* How connections are carried, selected with -m */
+typedef enum {
+    ENGINE_THREAD, // one detached thread per connection
+    ENGINE_POOL,   // fixed set of workers fed by a bounded queue
+    ENGINE_EPOLL,  // a few edge-triggered event loops
+    ENGINE_URING,  // a few io_uring loops, epoll where unsupported
+} engine_t;
 
 /*
  * clienterror - returns an error message to the client
@@ -67,261 +91,517 @@ static const char *header_proxy_connection = "Proxy-Connection: close\r\n";
  */
 void clienterror(int fd, const char *errnum, const char *shortmsg,
                  const char *longmsg) {
-    char buf[MAXLINE];
-    char body[MAXBUF];
+    char buf[MAXLINE + MAXBUF];
     size_t buflen;
-    size_t bodylen;
-
-    /* Build the HTTP response body */
-    bodylen = snprintf(body, MAXBUF,
-                       "<!DOCTYPE html>\r\n"
-                       "<html>\r\n"
-                       "<head><title>Proxy Error</title></head>\r\n"
-                       "<body bgcolor=\"ffffff\">\r\n"
-                       "<h1>%s: %s</h1>\r\n"
-                       "<p>%s</p>\r\n"
-                       "<hr /><em>The Proxy Web server</em>\r\n"
-                       "</body></html>\r\n",
-                       errnum, shortmsg, longmsg);
-    if (bodylen >= MAXBUF) {
-        return; // Overflow!
-    }
 
-    /* Build the HTTP response headers */
-    buflen = snprintf(buf, MAXLINE,
-                      "HTTP/1.0 %s %s\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: %zu\r\n\r\n",
-                      errnum, shortmsg, bodylen);
-    if (buflen >= MAXLINE) {
+    /* Build the HTTP response headers and body */
+    buflen = http_format_error(buf, sizeof(buf), errnum, shortmsg, longmsg);
+    if (buflen == 0) {
         return; // Overflow!
     }
 
-    /* Write the headers */
+    /* Write the response */
     if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing error response headers to client\n");
+        fprintf(stderr, "Error writing error response to client\n");
         return;
     }
+}
 
-    /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
-        fprintf(stderr, "Error writing error response body to client\n");
-        return;
+/* where a response read from the end server goes */
+typedef struct {
+    int connfd;
+    flight_t *flight; // followers to publish it to, or NULL
+    cache_fill_t fill;
+    bool cachable;
+    bool client_ok;  // still writing to the client
+    bool keep_alive; // the whole response came and delimits itself
+    // the request asked whether a stale hit changed: a 304 is not relayed
+    bool revalidating;
+    bool not_modified;  // it did not, the 304 was read but not relayed
+    long long lifetime; // how long the 304 says the stale hit stays fresh
+} relay_t;
+
+/*
+ * pass the next n bytes of the response on to the client, the flight's
+ * followers and the cache
+ * return false once nobody wants the rest of it
+ */
+static bool relay(relay_t *r, const char *buf, size_t n) {
+    if (r->client_ok && rio_writen(r->connfd, (void *)buf, n) < 0) {
+        r->client_ok = false;
+        r->cachable = false;
+        // followers still want the rest of the response
+        if (!r->flight) {
+            return false;
+        }
+    }
+    if (r->flight) {
+        flight_append(r->flight, buf, n);
+    }
+
+    if (r->cachable && !cache_fill_append(&r->fill, buf, n)) {
+        r->cachable = false;
     }
+    return true;
 }
 
 /*
- * serve - handle one HTTP request/response transaction
- * modify from the same function in tiny.c
+ * whether the rest of the response can skip the proxy: nobody but the
+ * client wants it, and the reader has nothing buffered that would have
+ * to go first
  */
-static void serve(int connfd) {
-    size_t n;
-    char buf[MAXLINE];
-    rio_t rio;
+static bool relay_can_splice(const reader_t *rd, const relay_t *r) {
+    return !r->cachable && !r->flight && r->client_ok &&
+           reader_buffered(rd) == 0 && splice_ready();
+}
 
-    rio_readinitb(&rio, connfd);
-    /* 1. Read request line */
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
-        return;
+/*
+ * splice len bytes of the response, or up to the close if negative
+ * return false if the server or the client gave up before that
+ */
+static bool relay_splice(reader_t *rd, relay_t *r, long long len) {
+    splice_result_t res = splice_relay(rd->fd, r->connfd, len);
+    if (res == SPLICE_OUT_FAILED) {
+        r->client_ok = false;
     }
-    // printf("%s", buf);
+    return res == SPLICE_DONE;
+}
 
-    parser_t *parser = parser_new();
-    if (!parser) {
-        return;
-    }
+/*
+ * relay exactly len bytes of the response
+ * return false if the server or the client gave up before that
+ */
+static bool relay_length(reader_t *rd, relay_t *r, long long len) {
+    const char *data;
 
-    /* 2. Parse request line and check if it's well-formed */
-    parser_state state = parser_parse_line(parser, buf);
-    if (state != REQUEST) {
-        clienterror(connfd, "400", "Bad Request",
-                    "Proxy could not parse the request line");
-        parser_free(parser);
-        return;
+    while (len > 0) {
+        if (relay_can_splice(rd, r)) {
+            return relay_splice(rd, r, len);
+        }
+        size_t want = len < READER_BUFSIZE ? (size_t)len : READER_BUFSIZE;
+        ssize_t n = reader_next(rd, &data, want);
+        if (n <= 0 || !relay(r, data, (size_t)n)) {
+            return false;
+        }
+        len -= n;
     }
+    return true;
+}
 
-    const char *method;
-    const char *uri;
-    const char *http_version;
-
-    // parse exactly 3 things for request line to be well-formed
-    if (parser_retrieve(parser, METHOD, &method) < 0 ||
-        parser_retrieve(parser, URI, &uri) < 0 ||
-        parser_retrieve(parser, HTTP_VERSION, &http_version) < 0) {
+/*
+ * relay a chunked body as it is, up to the empty line after the trailer
+ * return false if the server or the client gave up before that
+ */
+static bool relay_chunked(reader_t *rd, relay_t *r) {
+    const char *line;
+    ssize_t n;
 
-        clienterror(connfd, "400", "Bad Request",
-                    "Proxy could not parse the request line");
-        parser_free(parser);
-        return;
+    while (1) {
+        if ((n = reader_line(rd, &line)) <= 0 || !relay(r, line, (size_t)n)) {
+            return false;
+        }
+        char *end;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (end == line || size > LLONG_MAX - 2) {
+            return false; // not a chunk size line
+        }
+        if (size == 0) {
+            break;
+        }
+        // the chunk's data and the line ending after it
+        if (!relay_length(rd, r, (long long)size + 2)) {
+            return false;
+        }
     }
 
-    // Check that the method is GET (METHOD could be POST)
-    if (strcmp(method, "GET")) {
-        clienterror(connfd, "501", "Not Implemented",
-                    "Proxy  does not implement this method");
-        parser_free(parser);
-        return;
-    }
+    do {
+        if ((n = reader_line(rd, &line)) <= 0 || !relay(r, line, (size_t)n)) {
+            return false;
+        }
+    } while (n > 2 || line[0] != (n == 2 ? '\r' : '\n'));
+    return true;
+}
 
-    /* Support http only (no https) */
-    const char *scheme;
-    if (parser_retrieve(parser, SCHEME, &scheme) == 0 && scheme &&
-        strcasecmp(scheme, "http")) {
-        clienterror(connfd, "501", "Not Implemented",
-                    "Proxy does not support this protocol");
-        parser_free(parser);
+/*
+ * note how long the response may be cached and how to revalidate it
+ */
+static void note_freshness(relay_t *r, const http_response_t *resp) {
+    if (!http_response_cachable(resp)) {
+        r->cachable = false;
         return;
     }
+    cache_fill_freshness(&r->fill, http_response_lifetime(resp, time(NULL)),
+                         resp->etag.ptr, resp->etag.len,
+                         resp->last_modified.ptr, resp->last_modified.len);
+}
 
-    const char *host;
-    const char *port;
-    const char *path;
-
-    if (parser_retrieve(parser, HOST, &host) < 0) {
-        clienterror(connfd, "400", "Bad Request", "Proxy could not parse host");
-        parser_free(parser);
-        return;
+/*
+ * relay one response off a persistent connection, reading no further
+ * than its end; sets *reusable if the connection can take another request
+ * return 1 if the whole response was relayed, 0 if it broke off, or -1 if
+ * the server sent nothing at all
+ */
+static int relay_response(reader_t *rd, relay_t *r, bool *reusable) {
+    char *head;
+    const char *data;
+    bool complete;
+    http_response_t resp;
+    ssize_t n;
+
+    *reusable = false;
+    // status line and headers go to the client in one piece, straight
+    // from the reader's buffer
+    n = reader_head(rd, &head, &complete);
+    if (n < 0 && errno == EMSGSIZE) {
+        // too big to parse: passed on as it is, up to the close
+        resp.status = 0;
+        r->cachable = false;
+    } else if (n <= 0) {
+        return -1;
+    } else {
+        bool http = http_response_parse(&resp, head, (size_t)n);
+        if (complete && r->revalidating && resp.status == 304) {
+            // the caller answers from the stale hit instead
+            r->not_modified = true;
+            r->lifetime = http_response_lifetime(&resp, time(NULL));
+            r->keep_alive = http_response_keep_alive(&resp);
+            *reusable = r->keep_alive && reader_buffered(rd) == 0;
+            return 1;
+        }
+        note_freshness(r, &resp);
+        if (http_response_body(&resp) == HTTP_BODY_LENGTH &&
+            resp.content_length > MAX_OBJECT_SIZE - n) {
+            // known not to fit, so the body can be spliced from the start
+            r->cachable = false;
+        }
+        if (!relay(r, head, (size_t)n)) {
+            return 0;
+        }
+        if (!complete) {
+            // ended by the close, which cut it off unless it is not HTTP
+            return http ? 0 : 1;
+        }
     }
 
-    if (parser_retrieve(parser, PORT, &port) < 0) {
-        clienterror(connfd, "400", "Bad Request", "Proxy could not parse post");
-        parser_free(parser);
-        return;
+    switch (http_response_body(&resp)) {
+    case HTTP_BODY_NONE:
+        break;
+    case HTTP_BODY_LENGTH:
+        if (!relay_length(rd, r, resp.content_length)) {
+            return 0;
+        }
+        break;
+    case HTTP_BODY_CHUNKED:
+        if (!relay_chunked(rd, r)) {
+            return 0;
+        }
+        break;
+    case HTTP_BODY_CLOSE:
+        while (!relay_can_splice(rd, r)) {
+            if ((n = reader_next(rd, &data, READER_BUFSIZE)) <= 0) {
+                return n == 0;
+            }
+            if (!relay(r, data, (size_t)n)) {
+                return 0;
+            }
+        }
+        return relay_splice(rd, r, -1);
     }
 
-    if (parser_retrieve(parser, PATH, &path) < 0) {
-        clienterror(connfd, "400", "Bad Request", "Proxy could not parse path");
-        parser_free(parser);
-        return;
+    r->keep_alive = http_response_keep_alive(&resp);
+    // anything read past the end would be taken for the next response
+    *reusable = r->keep_alive && reader_buffered(rd) == 0;
+    return 1;
+}
+
+/*
+ * write all iovcnt iovecs at iov, which are advanced past what was sent
+ * return false on error
+ */
+static bool writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        iov = http_iov_advance(iov, &iovcnt, (size_t)n);
     }
+    return true;
+}
 
-    /* 3. read, parse, and buffer request header*/
-    // iv. create the request header
-    // v.  grab all client headers and store them in a buffer
-    bool has_own_host_header = false;
-    char header_host[MAXLINE] = {0};
-    char remaining_headers[MAXBUF] = {0};
+/*
+ * send the request to the end server and relay the response, over a
+ * pooled connection that is handed back if it can be reused with -k
+ * return true if the whole response was received
+ */
+static bool fetch_response(http_request_t *req, relay_t *r) {
+    struct iovec request[HTTP_REQUEST_IOVS];
 
-    while ((n = rio_readlineb(&rio, buf, MAXLINE)) > 0) {
-        // End of headers
-        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
-            break;
+    while (1) {
+        bool reused = false;
+        bool reusable;
+        reader_t server;
+
+        int serverfd = keepalive
+                           ? upstream_open(req->host, req->port, &reused)
+                           : dns_open_clientfd(req->host, req->port);
+        if (serverfd < 0) {
+            return false;
         }
+        reader_init(&server, serverfd);
 
-        if (!strncasecmp(buf, "Host:", 5)) {
-            has_own_host_header = true;
-            strncpy(header_host, buf, sizeof(header_host) - 1);
+        int done = -1;
+        int iovcnt = http_request_iov(req, keepalive, request);
+        if (writev_all(serverfd, request, iovcnt)) {
+            done = relay_response(&server, r, &reusable);
         }
-        // ignore client's own request header of User-Agent, Connection,
-        // Proxy-Connection
-        else if (!strncasecmp(buf, "User-Agent:", 11)) {
-            continue;
-        } else if (!strncasecmp(buf, "Connection:", 11)) {
+        if (done < 0 && reused) {
+            // the server closed the idle connection before it got the
+            // request, nothing was relayed yet: try the next one
+            close(serverfd);
             continue;
-        } else if (!strncasecmp(buf, "Proxy-Connection:", 17)) {
-            continue;
-        }
-        // Forward all remaining headers
-        else {
-            size_t current_len = strlen(remaining_headers);
-            if (current_len + strlen(buf) < sizeof(remaining_headers)) {
-                memcpy(remaining_headers + current_len, buf, strlen(buf) + 1);
-            }
         }
-    }
 
-    if (!has_own_host_header) {
-        if (strcmp(port, "80") != 0) {
-            snprintf(header_host, sizeof(header_host), "Host: %s:%s\r\n", host,
-                     port);
+        if (keepalive && done > 0 && reusable) {
+            upstream_release(req->host, req->port, serverfd);
         } else {
-            snprintf(header_host, sizeof(header_host), "Host: %s\r\n", host);
+            close(serverfd);
         }
+        return done > 0;
     }
+}
 
-    // check if the request is cached befroe calling server
-    const char *key = uri;
-    cache_obj_t *obj = search_cache_obj(key);
-    // hit
-    if (obj) {
-        size_t written_size = 0;
-        while (written_size < obj->size) {
-            size_t chunck_size = obj->size - written_size;
-            if (chunck_size > MAXLINE) {
-                chunck_size = MAXLINE;
+/*
+ * write the whole of a cached response to the client, in one syscall
+ * unless the socket buffer fills
+ * return false if the client went away before that
+ */
+static bool write_obj(int connfd, const cache_obj_t *obj) {
+    size_t written_size = 0;
+    while (written_size < obj->size) {
+        ssize_t n = cache_obj_write(connfd, obj, written_size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return false;
+        }
+        written_size += (size_t)n;
+    }
+    return true;
+}
 
-            if (rio_writen(connfd, obj->web_obj + written_size, chunck_size) <
-                0) {
-                break;
+/*
+ * fetch the request from the end server and relay the response to the
+ * client, publishing it to flight's followers if there is a flight
+ * if stale is a cached response gone stale, the end server is asked
+ * whether it changed, and it is served and kept on if it did not
+ * connfd is -1 for a refresh that serves no client
+ * sets *keep_alive if the client connection can take another request
+ * return true if the whole response was received
+ */
+static bool fetch(int connfd, http_request_t *req, flight_t *flight,
+                  cache_obj_t *stale, bool *keep_alive) {
+    const char *key = req->uri;
+
+    *keep_alive = false;
+    /* 4-5. Act as a client, and send request to end server*/
+    // forward response to client and store it for the cache on the way
+    relay_t r = {.connfd = connfd,
+                 .flight = flight,
+                 .cachable = true,
+                 .client_ok = connfd >= 0,
+                 .keep_alive = false};
+    if (stale && (stale->etag || stale->last_modified)) {
+        req->if_none_match = stale->etag;
+        req->if_modified_since = stale->last_modified;
+        r.revalidating = true;
+    }
+    cache_fill_init(&r.fill);
+    cache_fill_start(&r.fill);
+    bool fetched = fetch_response(req, &r);
+
+    if (fetched && r.not_modified) {
+        cache_obj_refresh(stale, r.lifetime);
+        cache_fill_discard(&r.fill);
+        if (flight) {
+            for (cache_segment_t *seg = stale->body; seg; seg = seg->next) {
+                flight_append(flight, seg->data, seg->len);
             }
-
-            written_size += chunck_size;
         }
-        free_cache_obj(obj);
-        parser_free(parser);
+        *keep_alive =
+            connfd >= 0 && write_obj(connfd, stale) && stale->keep_alive;
+        return true;
+    }
+
+    if (fetched && r.cachable && r.fill.size > 0) {
+        r.fill.keep_alive = r.keep_alive;
+        insert_cache_obj_to_cache(key, &r.fill);
+    }
+    cache_fill_discard(&r.fill);
+    *keep_alive = fetched && r.client_ok && r.keep_alive;
+    return fetched;
+}
+
+/*
+ * fetch obj's uri again for the cache alone, on a refresher thread
+ */
+static void refresh_fetch(cache_obj_t *obj) {
+    char buf[MAXLINE];
+    http_request_t req;
+    http_error_t err;
+    bool keep_alive;
+
+    int n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", obj->key);
+    if (n < 0 || (size_t)n >= sizeof(buf) ||
+        !http_request_parse(&req, buf, (size_t)n, &err)) {
         return;
     }
+    fetch(-1, &req, NULL, obj, &keep_alive);
+}
+
+/*
+ * follow a flight, writing its response to the client as it arrives
+ * return false if the fetch failed before anything was sent, so the
+ * caller can still fetch on its own
+ */
+static bool follow(int connfd, flight_t *flight) {
+    flight_reader_t reader = {NULL, 0, 0};
+    const char *data;
+    ssize_t n;
+
+    while ((n = flight_read(flight, &reader, &data)) > 0) {
+        if (rio_writen(connfd, (void *)data, (size_t)n) < 0) {
+            return true;
+        }
+    }
+    return n == 0 || reader.off > 0;
+}
 
-    /* 4. create request sent to end server*/
-    //    combine client's headers and proxy's headers
-    char request_line[MAXLINE];
-    char whole_request[MAXBUF];
-
-    snprintf(request_line, sizeof(request_line), "GET %s HTTP/1.0\r\n", path);
-
-    snprintf(whole_request, sizeof(whole_request),
-             "%s"
-             "%s"
-             "%s"
-             "%s"
-             "%s"
-             "%s"
-             "\r\n",
-             request_line, header_host, header_user_agent, header_connection,
-             header_proxy_connection, remaining_headers);
-
-    /* 5. Act as a client, and send request to end server*/
-    // viii. Open connection to the requested server and initialize a rio buffer
-    // for it ix.   Write the http header into the server buffer x.    Read
-    // responses off the server buffer and write them to the client buffer xi.
-    // Free parser and close file descriptors
-    int clientfd;
-    rio_t client_rio;
-
-    clientfd = open_clientfd(host, port);
-    rio_readinitb(&client_rio, clientfd);
-    // forward request to server
-    if (rio_writen(clientfd, whole_request, strlen(whole_request)) < 0) {
-        close(clientfd);
-        parser_free(parser);
+/*
+ * hand a CONNECT over to a tunnel, with whatever the client sent after
+ * its header, or tell the client why not
+ */
+static void open_tunnel(int connfd, reader_t *rd, const http_request_t *req) {
+    dns_result_t addrs;
+    if (dns_resolve(req->host, req->port, &addrs) != 0) {
+        clienterror(connfd, "502", "Bad Gateway",
+                    "Proxy could not resolve the end server");
         return;
     }
+    if (!tunnel_open(connfd, &addrs, rd->pos, reader_buffered(rd))) {
+        clienterror(connfd, "503", "Service Unavailable",
+                    "Proxy could not open a tunnel");
+    }
+}
+
+/*
+ * serve - handle one HTTP request/response transaction
+ * modify from the same function in tiny.c
+ * rd buffers the client connection across requests, so pipelined ones
+ * are answered in order
+ * return true if the connection can take another request
+ */
+static bool serve(int connfd, reader_t *rd) {
+    char *head;
+    bool complete;
+    http_request_t req;
+    http_error_t err;
+    bool keep_alive = false;
+
+    /* 1. Read request line and header, as they are */
+    ssize_t n = reader_head(rd, &head, &complete);
+    if (n < 0 && errno == EMSGSIZE) {
+        clienterror(connfd, "400", "Bad Request",
+                    "Proxy could not fit the request headers");
+        return false;
+    }
+    if (n <= 0) {
+        return false;
+    }
 
-    // forward response to client and save to buffer
-    char web_obj_buffer[MAX_OBJECT_SIZE];
-    size_t obj_size = 0; // offset
-    bool cachable = true;
+    /* 2. Parse it in place and check if it's well-formed */
+    if (!http_request_parse(&req, head, (size_t)n, &err)) {
+        clienterror(connfd, err.errnum, err.shortmsg, err.longmsg);
+        return false;
+    }
+    // a tunnel carries on over its own copy of the connection
+    if (req.method == HTTP_METHOD_CONNECT) {
+        open_tunnel(connfd, rd, &req);
+        return false;
+    }
+    // a request cut short still gets an answer, but nothing after it
+    if (!complete) {
+        req.keep_alive = false;
+    }
 
-    while ((n = rio_readnb(&client_rio, buf, sizeof(buf))) > 0) {
-        if (rio_writen(connfd, buf, (size_t)n) < 0) {
-            cachable = false;
-            break;
-        }
+    // check if the request is cached befroe calling server
+    const char *key = req.uri;
+    cache_obj_t *obj = search_cache_obj(key);
+    bool hit = obj && cache_obj_fresh(obj);
+    if (obj && !hit && refresh_enabled()) {
+        // served stale while a refresher asks the end server
+        refresh_submit(obj);
+        hit = true;
+    }
+    // hit
+    if (hit) {
+        keep_alive =
+            write_obj(connfd, obj) && req.keep_alive && obj->keep_alive;
+        free_cache_obj(obj);
+        return keep_alive;
+    }
 
-        if (obj_size + (size_t)n <= MAX_OBJECT_SIZE) {
-            memcpy(web_obj_buffer + obj_size, buf, (size_t)n);
-            obj_size += (size_t)n;
-        } else {
-            cachable = false;
+    // miss, or a stale hit to revalidate: ride along if somebody is
+    // already fetching it
+    flight_t *flight = NULL;
+    if (coalesce) {
+        bool leader;
+        flight = flight_join(key, &leader);
+        if (flight && !leader) {
+            bool served = follow(connfd, flight);
+            flight_release(flight);
+            flight = NULL;
+            if (served) {
+                // followers do not learn how the response is framed
+                free_cache_obj(obj);
+                return false;
+            }
         }
     }
-    if (cachable && obj_size > 0) {
-        insert_cache_obj_to_cache(key, obj_size, web_obj_buffer);
+
+    bool fetched = fetch(connfd, &req, flight, obj, &keep_alive);
+    free_cache_obj(obj);
+    if (flight) {
+        // after the insert, so requests that miss the flight hit the cache
+        flight_finish(flight, fetched);
+        flight_release(flight);
     }
+    keep_alive = keep_alive && req.keep_alive;
+    return keep_alive;
+}
 
-    close(clientfd);
-    parser_free(parser);
+/*
+ * serve requests on an accepted connection for as long as the client
+ * keeps it open and the responses allow it, then close it
+ */
+static void serve_connection(int connfd) {
+    reader_t rd;
+    bool waiting = false;
+
+    reader_init(&rd, connfd);
+    while (serve(connfd, &rd)) {
+        // drop clients that keep the connection but send nothing more
+        if (!waiting) {
+            struct timeval idle = {CLIENT_IDLE_TIMEOUT, 0};
+            setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+            waiting = true;
+        }
+    }
+    close(connfd);
 }
 
 /*
@@ -332,23 +612,133 @@ void *thread(void *vargp) {
     int connfd = *((int *)vargp);
     pthread_detach(pthread_self());
     free(vargp);
-    // one request each time
-    serve(connfd); // echo
-    close(connfd);
+    serve_connection(connfd);
     return NULL;
 }
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-m thread|pool|epoll|uring] [-t threads] [-q queue] "
+            "[-s shards] [-e lru|s3fifo|tinylfu|gdsf|gdsf-latency] "
+            "[-d file] [-D megabytes] [-p snapshot] [-c] [-k] [-r] [-R] [-A] "
+            "<port>\n",
+            prog);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
     // printf("%s", header_user_agent);
 
     // 1. Check arguments (argc/argv).
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
+    engine_t engine = ENGINE_THREAD;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    long queue_size = LISTENQ;
+    long cache_shards = 1;
+    bool refresh = false;
+    const char *disk_path = NULL;
+    long disk_mb = DISK_CACHE_SIZE / (1024 * 1024);
+    const char *snapshot_path = NULL;
+    bool reuseport = false;
+    bool pin = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:t:q:s:e:d:D:p:ckrRA")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "thread")) {
+                engine = ENGINE_THREAD;
+            } else if (!strcmp(optarg, "pool")) {
+                engine = ENGINE_POOL;
+            } else if (!strcmp(optarg, "epoll")) {
+                engine = ENGINE_EPOLL;
+            } else if (!strcmp(optarg, "uring")) {
+                engine = ENGINE_URING;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            queue_size = strtol(optarg, NULL, 10);
+            if (queue_size < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            cache_shards = strtol(optarg, NULL, 10);
+            if (cache_shards < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'e':
+            if (!cache_use_policy(optarg)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            disk_path = optarg;
+            break;
+        case 'D':
+            disk_mb = strtol(optarg, NULL, 10);
+            if (disk_mb < DISK_MIN_SIZE / (1024 * 1024)) {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            snapshot_path = optarg;
+            break;
+        case 'c':
+            coalesce = true;
+            break;
+        case 'k':
+            keepalive = true;
+            break;
+        case 'r':
+            refresh = true;
+            break;
+        case 'R':
+            reuseport = true;
+            break;
+        case 'A':
+            pin = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    // only event loops own their connections end to end
+    if ((reuseport || pin) && engine != ENGINE_EPOLL &&
+        engine != ENGINE_URING) {
+        usage(argv[0]);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
     }
 
     // create cache
-    init_cache();
+    init_cache((int)cache_shards);
+    if (disk_path &&
+        !cache_use_disk(disk_path, (size_t)disk_mb * 1024 * 1024)) {
+        fprintf(stderr, "could not set up the disk cache %s\n", disk_path);
+        exit(1);
+    }
+    // before any other thread, so that they all block its signals
+    if (snapshot_path && !snapshot_start(snapshot_path)) {
+        fprintf(stderr, "could not set up the snapshot %s\n", snapshot_path);
+        exit(1);
+    }
+    if (refresh && !refresh_start(refresh_fetch)) {
+        fprintf(stderr, "could not start the refresher threads\n");
+        exit(1);
+    }
 
     // 2. Set up listening socket with open_listenfd
     Signal(SIGPIPE, SIG_IGN);
@@ -359,8 +749,35 @@ int main(int argc, char **argv) {
     struct sockaddr_storage clientaddr; /* Enough space for any addr */
     pthread_t tid;
 
+    if (engine == ENGINE_EPOLL || engine == ENGINE_URING) {
+        listeners_t listeners;
+        if (!listeners_open(&listeners, argv[optind], (int)nthreads,
+                            reuseport, pin)) {
+            exit(1);
+        }
+        if (engine == ENGINE_URING &&
+            !uring_run(&listeners, (int)nthreads)) {
+            fprintf(stderr, "io_uring not available, using epoll\n");
+        }
+        event_run(&listeners, (int)nthreads);
+    }
+
+    listenfd = open_listenfd(argv[optind]);
+    if (listenfd < 0) {
+        exit(1);
+    }
+
+    pool_t *pool = NULL;
+    if (engine == ENGINE_POOL) {
+        pool = pool_create((int)nthreads, (size_t)queue_size,
+                           serve_connection);
+        if (!pool) {
+            fprintf(stderr, "could not start the worker pool\n");
+            exit(1);
+        }
+    }
+
     // 4. Within a thread:
-    listenfd = open_listenfd(argv[1]);
     while (1) {
         clientlen = sizeof(struct sockaddr_storage);
         connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
@@ -368,6 +785,16 @@ int main(int argc, char **argv) {
             continue;
         }
 
+        if (pool) {
+            // all workers busy and queue full: shed load right here
+            if (!pool_submit(pool, connfd)) {
+                clienterror(connfd, "503", "Service Unavailable",
+                            "Proxy is overloaded, try again later");
+                close(connfd);
+            }
+            continue;
+        }
+
         // to prevent race condition of local variable, connfd
         // save it to heap
         int *connfd_pt = malloc(sizeof(int));
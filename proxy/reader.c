@@ -0,0 +1,150 @@
+/*
+ * reader.c - zero-copy buffered reader
+ *
+ * The buffer holds the bytes in [pos, end) that were read but not handed
+ * out yet. Reading more appends after end; only when end reaches the end
+ * of the buffer are the pending bytes moved to its front, so a line or
+ * header that straddles two reads is still returned in one piece.
+ */
+#include "reader.h"
+#include "scan.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+void reader_init(reader_t *r, int fd) {
+    r->fd = fd;
+    r->pos = r->buf;
+    r->end = r->buf;
+    r->scanned = 0;
+    r->buf[0] = '\0';
+}
+
+/*
+ * read more from the socket after the pending bytes, which must not fill
+ * the whole buffer
+ * return how many bytes were read, 0 at EOF, or -1 on error
+ */
+static ssize_t fill(reader_t *r) {
+    size_t pending = (size_t)(r->end - r->pos);
+
+    if (r->end == r->buf + READER_BUFSIZE) {
+        memmove(r->buf, r->pos, pending);
+        r->pos = r->buf;
+        r->end = r->buf + pending;
+    }
+    while (1) {
+        size_t room = (size_t)(r->buf + READER_BUFSIZE - r->end);
+        ssize_t n = read(r->fd, r->end, room);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n > 0) {
+            r->end += n;
+            *r->end = '\0';
+        }
+        return n;
+    }
+}
+
+/*
+ * hand out the next len bytes
+ */
+static char *take(reader_t *r, size_t len) {
+    char *data = r->pos;
+    r->pos += len;
+    r->scanned = 0;
+    if (r->pos == r->end) {
+        // start over at the front while nothing is pending, the bytes
+        // handed out stay where they are until the next read
+        r->pos = r->buf;
+        r->end = r->buf;
+    }
+    return data;
+}
+
+ssize_t reader_line(reader_t *r, const char **line) {
+    size_t from = 0;
+
+    while (1) {
+        const char *nl = scan_line(r->pos + from, r->end, NULL);
+        if (nl) {
+            size_t len = (size_t)(nl + 1 - r->pos);
+            *line = take(r, len);
+            return (ssize_t)len;
+        }
+        from = (size_t)(r->end - r->pos);
+        if (from == READER_BUFSIZE) {
+            break; // no line ending in a full buffer
+        }
+        ssize_t n = fill(r);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            if (from == 0) {
+                return 0;
+            }
+            break;
+        }
+    }
+    *line = take(r, from);
+    return (ssize_t)from;
+}
+
+ssize_t reader_head(reader_t *r, char **head, bool *complete) {
+    *complete = false;
+
+    while (1) {
+        // the lines not looked at yet, up to an empty one
+        const char *p = r->pos + r->scanned;
+        const char *nl;
+        while ((nl = scan_line(p, r->end, NULL))) {
+            bool empty = nl == p || (nl == p + 1 && *p == '\r');
+            p = nl + 1;
+            if (empty) {
+                size_t len = (size_t)(p - r->pos);
+                *complete = true;
+                *head = take(r, len);
+                return (ssize_t)len;
+            }
+        }
+        r->scanned = (size_t)(p - r->pos);
+
+        size_t pending = (size_t)(r->end - r->pos);
+        if (pending == READER_BUFSIZE) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        ssize_t n = fill(r);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            if (pending > 0) {
+                *head = take(r, pending);
+            }
+            return (ssize_t)pending;
+        }
+    }
+}
+
+ssize_t reader_next(reader_t *r, const char **data, size_t max) {
+    if (r->pos == r->end) {
+        ssize_t n = fill(r);
+        if (n <= 0) {
+            return n;
+        }
+    }
+    size_t len = (size_t)(r->end - r->pos);
+    if (len > max) {
+        len = max;
+    }
+    *data = take(r, len);
+    return (ssize_t)len;
+}
+
+size_t reader_buffered(const reader_t *r) {
+    return (size_t)(r->end - r->pos);
+}
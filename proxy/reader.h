@@ -0,0 +1,59 @@
+#ifndef READER_H
+#define READER_H
+
+#include "csapp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Buffered reader that hands out slices of its buffer instead of copying.
+ *
+ * Like rio it reads a socket in MAXBUF pieces, but lines, whole request
+ * or response headers and body bytes are returned as pointers into its
+ * own buffer, found with the vectorized scanner in scan.h. A slice stays
+ * valid until the next call on the same reader. The buffered data is
+ * always followed by a '\0', so string functions stop at its end.
+ */
+#define READER_BUFSIZE MAXBUF
+
+typedef struct {
+    int fd;
+    char *pos;      // first byte not handed out yet
+    char *end;      // end of the bytes read so far
+    size_t scanned; // bytes after pos searched for the end of a header
+    char buf[READER_BUFSIZE + 1];
+} reader_t;
+
+void reader_init(reader_t *r, int fd);
+
+/*
+ * the next line, with its line ending, in *line
+ * a line longer than the buffer is returned in buffer-sized pieces
+ * return its length, 0 at EOF, or -1 on error; the last line before EOF
+ * may have no line ending
+ */
+ssize_t reader_line(reader_t *r, const char **line);
+
+/*
+ * the next request or response header, up to and including the empty
+ * line ending it, in *head; sets *complete unless EOF came first
+ * return its length, 0 at EOF, or -1 on error; errno is EMSGSIZE if it
+ * does not fit in the buffer, which still holds what was read of it
+ */
+ssize_t reader_head(reader_t *r, char **head, bool *complete);
+
+/*
+ * up to max of the next bytes in *data, reading more only if none are
+ * buffered
+ * return how many, 0 at EOF, or -1 on error
+ */
+ssize_t reader_next(reader_t *r, const char **data, size_t max);
+
+/*
+ * number of bytes read from the socket but not handed out yet
+ */
+size_t reader_buffered(const reader_t *r);
+
+#endif
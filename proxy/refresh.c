@@ -0,0 +1,180 @@
+/*
+ * refresh.c - background refresh of stale and soon stale cache objects
+ *
+ * Objects to refresh wait in a fixed ring under one lock, each holding
+ * a reference and its refreshing flag, so an object is queued at most
+ * once however often it is hit meanwhile. Refresher threads sleep on a
+ * condition variable while the ring is empty. The origins being
+ * refreshed are counted in a table with one slot per thread, which is
+ * all that can be busy at once.
+ */
+#include "refresh.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ORIGIN_SIZE 272 // host[256] ':' port[8], as in http_request_t
+
+typedef struct {
+    char origin[ORIGIN_SIZE]; // host:port, while busy
+    int busy;                 // refreshes under way
+} origin_slot_t;
+
+static struct {
+    bool enabled;
+    void (*fetch)(cache_obj_t *obj);
+    pthread_mutex_t mutex;
+    pthread_cond_t queued; // something was queued
+    int waiting;           // threads sleeping on queued
+    cache_obj_t *ring[REFRESH_QUEUE];
+    size_t head; // next to take
+    size_t count;
+    origin_slot_t origins[REFRESH_THREADS];
+} refresh = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+             .queued = PTHREAD_COND_INITIALIZER};
+
+/*
+ * copy the host:port part of an absolute uri key to origin
+ */
+static void origin_of(const char *key, char *origin) {
+    const char *start = strstr(key, "://");
+    start = start ? start + 3 : key;
+    size_t len = strcspn(start, "/");
+    if (len >= ORIGIN_SIZE) {
+        len = ORIGIN_SIZE - 1;
+    }
+    memcpy(origin, start, len);
+    origin[len] = '\0';
+}
+
+/*
+ * count one more refresh to origin, must hold refresh.mutex
+ * return false if it already has REFRESH_PER_ORIGIN under way
+ */
+static bool origin_acquire(const char *origin) {
+    origin_slot_t *free_slot = NULL;
+    for (int i = 0; i < REFRESH_THREADS; i++) {
+        origin_slot_t *slot = &refresh.origins[i];
+        if (slot->busy && !strcmp(slot->origin, origin)) {
+            if (slot->busy >= REFRESH_PER_ORIGIN) {
+                return false;
+            }
+            slot->busy++;
+            return true;
+        }
+        if (!slot->busy && !free_slot) {
+            free_slot = slot;
+        }
+    }
+    // a thread only asks while it refreshes nothing, so a slot is free
+    strcpy(free_slot->origin, origin);
+    free_slot->busy = 1;
+    return true;
+}
+
+/*
+ * a refresh to origin is done, must hold refresh.mutex
+ */
+static void origin_release(const char *origin) {
+    for (int i = 0; i < REFRESH_THREADS; i++) {
+        origin_slot_t *slot = &refresh.origins[i];
+        if (slot->busy && !strcmp(slot->origin, origin)) {
+            slot->busy--;
+            return;
+        }
+    }
+}
+
+static void *refresher(void *vargp) {
+    char origin[ORIGIN_SIZE];
+
+    (void)vargp;
+    while (1) {
+        pthread_mutex_lock(&refresh.mutex);
+        while (refresh.count == 0) {
+            refresh.waiting++;
+            pthread_cond_wait(&refresh.queued, &refresh.mutex);
+            refresh.waiting--;
+        }
+        cache_obj_t *obj = refresh.ring[refresh.head];
+        refresh.head = (refresh.head + 1) % REFRESH_QUEUE;
+        refresh.count--;
+        origin_of(obj->key, origin);
+        bool allowed = origin_acquire(origin);
+        pthread_mutex_unlock(&refresh.mutex);
+
+        if (allowed) {
+            refresh.fetch(obj);
+            pthread_mutex_lock(&refresh.mutex);
+            origin_release(origin);
+            pthread_mutex_unlock(&refresh.mutex);
+        }
+        __atomic_store_n(&obj->refreshing, 0, __ATOMIC_RELEASE);
+        free_cache_obj(obj);
+    }
+    return NULL;
+}
+
+/*
+ * queue the hot objects about to go stale every REFRESH_PERIOD seconds
+ */
+static void *scanner(void *vargp) {
+    cache_obj_t *objs[REFRESH_HOT];
+
+    (void)vargp;
+    while (1) {
+        sleep(REFRESH_PERIOD);
+        int n = cache_expiring_hot(objs, REFRESH_HOT, REFRESH_AHEAD);
+        for (int i = 0; i < n; i++) {
+            refresh_submit(objs[i]);
+            free_cache_obj(objs[i]);
+        }
+    }
+    return NULL;
+}
+
+bool refresh_start(void (*fetch)(cache_obj_t *obj)) {
+    pthread_t tid;
+
+    refresh.fetch = fetch;
+    for (int i = 0; i < REFRESH_THREADS; i++) {
+        if (pthread_create(&tid, NULL, refresher, NULL) != 0) {
+            return false;
+        }
+        pthread_detach(tid);
+    }
+    if (pthread_create(&tid, NULL, scanner, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(tid);
+    refresh.enabled = true;
+    return true;
+}
+
+bool refresh_enabled(void) {
+    return refresh.enabled;
+}
+
+void refresh_submit(cache_obj_t *obj) {
+    if (__atomic_exchange_n(&obj->refreshing, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    cache_obj_hold(obj);
+
+    pthread_mutex_lock(&refresh.mutex);
+    bool full = refresh.count == REFRESH_QUEUE;
+    if (!full) {
+        refresh.ring[(refresh.head + refresh.count) % REFRESH_QUEUE] = obj;
+        refresh.count++;
+        if (refresh.waiting > 0) {
+            pthread_cond_signal(&refresh.queued);
+        }
+    }
+    pthread_mutex_unlock(&refresh.mutex);
+
+    if (full) {
+        __atomic_store_n(&obj->refreshing, 0, __ATOMIC_RELEASE);
+        free_cache_obj(obj);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include "cache.h"
+
+#include <stdbool.h>
+
+/*
+ * Background refresh of cached objects, enabled with "./proxy -r <port>".
+ *
+ * A stale hit is served at once and the object queued for one of the
+ * refresher threads, which revalidates or refetches it, so no client
+ * waits on the end server for a hot object that just expired. Every
+ * REFRESH_PERIOD seconds the REFRESH_HOT most hit objects that expire in
+ * the next REFRESH_AHEAD seconds are queued too, to be refreshed before
+ * anybody sees them stale. At most REFRESH_PER_ORIGIN refreshes go to
+ * one host and port at a time; the rest are dropped and left for the
+ * next stale hit.
+ */
+#define REFRESH_THREADS 4
+#define REFRESH_QUEUE 256
+#define REFRESH_PERIOD 1
+#define REFRESH_AHEAD 2
+#define REFRESH_HOT 16
+#define REFRESH_PER_ORIGIN 2
+
+/*
+ * start the refresher threads and the scan for hot objects; fetch is
+ * called on a refresher thread to fetch obj->key again, revalidating obj
+ * return false on failure
+ */
+bool refresh_start(void (*fetch)(cache_obj_t *obj));
+
+/*
+ * whether refresh_start was called, so stale hits may be served
+ */
+bool refresh_enabled(void);
+
+/*
+ * queue obj to be refreshed, unless it already is or the queue is full
+ * the queue takes its own reference to obj
+ */
+void refresh_submit(cache_obj_t *obj);
+
+#endif
@@ -0,0 +1,96 @@
+#include "ring.h"
+
+#include <stdlib.h>
+
+/*
+ * allocate room for at least capacity values
+ * return 0 on success, -1 if out of memory
+ */
+int ring_init(ring_t *ring, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    ring->slots = malloc(size * sizeof(ring_slot_t));
+    if (!ring->slots) {
+        return -1;
+    }
+    // slot i is free for the producer that claims position i
+    for (size_t i = 0; i < size; i++) {
+        ring->slots[i].seq = i;
+    }
+    ring->mask = size - 1;
+    ring->tail = 0;
+    ring->head = 0;
+    return 0;
+}
+
+void ring_destroy(ring_t *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/*
+ * append value, return false if the ring is full
+ */
+bool ring_push(ring_t *ring, intptr_t value) {
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    ring_slot_t *slot;
+
+    while (1) {
+        slot = &ring->slots[pos & ring->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // slot is free, try to claim position pos
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // slot still holds the value from one lap ago
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->value = value;
+    // publish to the consumer that claims position pos
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * remove the oldest value into *value, return false if the ring is empty
+ */
+bool ring_pop(ring_t *ring, intptr_t *value) {
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    ring_slot_t *slot;
+
+    while (1) {
+        slot = &ring->slots[pos & ring->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            // slot is filled, try to claim position pos
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // producer of this position has not published yet
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    *value = slot->value;
+    // hand the slot back to the producer one lap ahead
+    __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
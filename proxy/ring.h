@@ -0,0 +1,45 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded multi-producer/multi-consumer queue (Vyukov's array queue).
+ * Producers and consumers never take a lock: each slot carries a sequence
+ * number telling whether it is ready to be written or to be read, and the
+ * head/tail positions are claimed with compare-and-swap.
+ */
+typedef struct {
+    size_t seq;
+    intptr_t value;
+} ring_slot_t;
+
+typedef struct {
+    ring_slot_t *slots;
+    size_t mask; // capacity - 1, capacity is a power of two
+    // producers and consumers spin on different cache lines
+    size_t tail __attribute__((aligned(64)));
+    size_t head __attribute__((aligned(64)));
+} ring_t;
+
+/*
+ * allocate room for at least capacity values
+ * return 0 on success, -1 if out of memory
+ */
+int ring_init(ring_t *ring, size_t capacity);
+
+void ring_destroy(ring_t *ring);
+
+/*
+ * append value, return false if the ring is full
+ */
+bool ring_push(ring_t *ring, intptr_t value);
+
+/*
+ * remove the oldest value into *value, return false if the ring is empty
+ */
+bool ring_pop(ring_t *ring, intptr_t *value);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * scan.c - SIMD line and delimiter scanning
+ *
+ * A block of input is compared against '\n' and ':' splatted across a
+ * vector register, and each comparison is folded into a bit mask with
+ * movemask, one bit per byte. The lowest set bit of the newline mask is
+ * the line end; the colon mask, cut off below that bit, gives the first
+ * separator of the line. The bytes left over at the end, fewer than a
+ * vector, go through the scalar loop.
+ *
+ * The AVX2 loop is compiled with a target attribute, so the rest of the
+ * proxy does not need -mavx2, and is only picked if cpuid reports it.
+ */
+#include "scan.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_fn_t)(const char *, const char *, const char **);
+
+static const char *scan_scalar(const char *p, const char *end,
+                               const char **colon) {
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            return p;
+        }
+        if (*p == ':' && colon && !*colon) {
+            *colon = p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+/*
+ * note the first colon among the bits of colons below the newline bit
+ * (all of them if there is no newline) of the block at p
+ */
+static inline void first_colon(const char *p, unsigned colons,
+                               unsigned newlines, const char **colon) {
+    if (newlines) {
+        colons &= (newlines & -newlines) - 1;
+    }
+    if (colons) {
+        *colon = p + __builtin_ctz(colons);
+    }
+}
+
+static const char *scan_sse2(const char *p, const char *end,
+                             const char **colon) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i co = _mm_set1_epi8(':');
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned newlines =
+            (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (colon && !*colon) {
+            unsigned colons =
+                (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, co));
+            first_colon(p, colons, newlines, colon);
+        }
+        if (newlines) {
+            return p + __builtin_ctz(newlines);
+        }
+        p += 16;
+    }
+    return scan_scalar(p, end, colon);
+}
+
+__attribute__((target("avx2"))) static const char *
+scan_avx2(const char *p, const char *end, const char **colon) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i co = _mm256_set1_epi8(':');
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned newlines =
+            (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (colon && !*colon) {
+            unsigned colons =
+                (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, co));
+            first_colon(p, colons, newlines, colon);
+        }
+        if (newlines) {
+            return p + __builtin_ctz(newlines);
+        }
+        p += 32;
+    }
+    return scan_sse2(p, end, colon);
+}
+#endif
+
+/* resolved on first use, every thread resolves it to the same one */
+static scan_fn_t scan_impl;
+
+static scan_fn_t scan_best(void) {
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2;
+    }
+    return scan_sse2;
+#else
+    return scan_scalar;
+#endif
+}
+
+const char *scan_line(const char *p, const char *end, const char **colon) {
+    scan_fn_t fn = __atomic_load_n(&scan_impl, __ATOMIC_RELAXED);
+    if (!fn) {
+        fn = scan_best();
+        __atomic_store_n(&scan_impl, fn, __ATOMIC_RELAXED);
+    }
+    if (colon) {
+        *colon = NULL;
+    }
+    return fn(p, end, colon);
+}
+
+bool scan_use(const char *name) {
+    scan_fn_t fn = NULL;
+
+    if (!strcmp(name, "scalar")) {
+        fn = scan_scalar;
+    }
+#ifdef SCAN_X86
+    if (!strcmp(name, "sse2")) {
+        fn = scan_sse2;
+    }
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        fn = scan_avx2;
+    }
+#endif
+    if (!fn) {
+        return false;
+    }
+    __atomic_store_n(&scan_impl, fn, __ATOMIC_RELAXED);
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+
+/*
+ * Vectorized search for the bytes that delimit HTTP header lines.
+ *
+ * Header bytes are compared 32 at a time with AVX2 or 16 at a time with
+ * SSE2, whichever the CPU has, against both the line feed and the colon
+ * in one pass, instead of looking at them one by one. Other machines get
+ * a plain loop.
+ */
+
+/*
+ * the first '\n' in [p, end), or NULL if there is none
+ * if colon is not NULL, set it to the first ':' before that '\n' (or
+ * before end if there is none), or NULL if there is none
+ */
+const char *scan_line(const char *p, const char *end, const char **colon);
+
+/*
+ * use the named implementation from now on: "scalar", "sse2" or "avx2"
+ * for benchmarks; by default the widest one the CPU has is used
+ * return false if it is unknown or the CPU cannot run it
+ */
+bool scan_use(const char *name);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * sketch.c - count-min sketch with periodic halving
+ *
+ * The row index of a key is taken from the high bits of its hash times
+ * a different odd constant per row, so one 64-bit hash serves all rows.
+ */
+#include "sketch.h"
+
+#include <stdlib.h>
+
+static const uint64_t row_seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL,
+    0xd6e8feb86659fd93ULL};
+
+static size_t slot_of(const sketch_t *sketch, int row, uint64_t hash) {
+    uint64_t mixed = (hash ^ (hash >> 29)) * row_seeds[row];
+    return (size_t)row * (sketch->mask + 1) +
+           (size_t)(mixed >> 32 & sketch->mask);
+}
+
+bool sketch_init(sketch_t *sketch, size_t keys) {
+    size_t slots = 16;
+    while (slots < SKETCH_WIDTH * keys) {
+        slots *= 2;
+    }
+    sketch->counters = calloc(SKETCH_DEPTH * slots, 1);
+    if (!sketch->counters) {
+        return false;
+    }
+    sketch->mask = slots - 1;
+    sketch->sample_size = 10 * keys;
+    sketch->samples = 0;
+    return true;
+}
+
+/*
+ * halve every counter, by the thread whose lookup reached the sample size
+ */
+static void sketch_age(sketch_t *sketch) {
+    size_t n = SKETCH_DEPTH * (sketch->mask + 1);
+    for (size_t i = 0; i < n; i++) {
+        uint8_t c = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&sketch->counters[i], c / 2, __ATOMIC_RELAXED);
+    }
+}
+
+void sketch_add(sketch_t *sketch, uint64_t hash) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *c = &sketch->counters[slot_of(sketch, row, hash)];
+        if (__atomic_load_n(c, __ATOMIC_RELAXED) < SKETCH_MAX) {
+            __atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (__atomic_add_fetch(&sketch->samples, 1, __ATOMIC_RELAXED) ==
+        sketch->sample_size) {
+        sketch_age(sketch);
+        __atomic_store_n(&sketch->samples, 0, __ATOMIC_RELAXED);
+    }
+}
+
+unsigned sketch_estimate(const sketch_t *sketch, uint64_t hash) {
+    unsigned min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        const uint8_t *c = &sketch->counters[slot_of(sketch, row, hash)];
+        unsigned count = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (count < min) {
+            min = count;
+        }
+    }
+    return min;
+}
@@ -0,0 +1,48 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Count-min sketch of how often keys were looked up lately, for
+ * TinyLFU admission.
+ *
+ * Each key hash bumps one small counter in each of SKETCH_DEPTH rows and
+ * its estimate is the least of them, which overcounts only when every row
+ * collides. Rows have SKETCH_WIDTH counters per key the sketch is sized
+ * for, so that they stay mostly small. Counters stop at SKETCH_MAX, and
+ * once 10 lookups per key were counted all of them are halved, so old
+ * popularity fades. Counting
+ * takes no lock: counters are bumped atomically, and an increment lost to
+ * a racing halving only makes the estimate a bit lower.
+ */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 8
+#define SKETCH_MAX 15
+
+typedef struct {
+    uint8_t *counters;  // SKETCH_DEPTH rows of width counters
+    size_t mask;        // width - 1, width is a power of two
+    size_t sample_size; // lookups between halvings
+    size_t samples;     // lookups counted since the last halving
+} sketch_t;
+
+/*
+ * allocate counters for about keys keys
+ * return false if out of memory
+ */
+bool sketch_init(sketch_t *sketch, size_t keys);
+
+/*
+ * count a lookup of hash, never takes a lock
+ */
+void sketch_add(sketch_t *sketch, uint64_t hash);
+
+/*
+ * how often hash was looked up lately, at most SKETCH_MAX
+ */
+unsigned sketch_estimate(const sketch_t *sketch, uint64_t hash);
+
+#endif
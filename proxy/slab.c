@@ -0,0 +1,147 @@
+/*
+ * slab.c - size-classed arena carved from mmap'd regions
+ *
+ * Each class has its own lock, free list and current region. A region is
+ * used as a bump allocator, so pages of a fresh region are only touched
+ * once slots on them are handed out; freed slots are linked through their
+ * first word and reused first. The locks are spin locks: they are held
+ * for a few instructions, less than parking a thread on a mutex costs.
+ */
+#define _GNU_SOURCE
+#include "slab.h"
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define SLAB_REGION_SIZE (64 * 1024)
+
+/*
+ * slot sizes, roughly four per power of two so no more than a third of a
+ * slot is wasted; all multiples of 16 so slots stay aligned
+ */
+static const size_t class_size[] = {
+    16,   32,   48,   64,   80,   96,   128,  160,  192,
+    256,  320,  384,  512,  640,  768,  1024, 1280, 1536,
+    2048, 2560, 3072, 4096, 5120, 6144, 8192};
+#define SLAB_CLASSES (sizeof(class_size) / sizeof(class_size[0]))
+
+typedef struct slot {
+    struct slot *next;
+} slot_t;
+
+typedef struct {
+    bool lock;
+    slot_t *free;     // freed slots, reused first
+    char *bump;       // next never used slot of the current region
+    char *end;        // end of the current region
+    size_t mapped;    // bytes of regions
+    size_t slots;     // slots handed out
+    size_t requested; // bytes callers asked for in those slots
+} __attribute__((aligned(64))) slab_class_t;
+
+static slab_class_t classes[SLAB_CLASSES];
+
+static void class_lock(slab_class_t *cls) {
+    while (__atomic_test_and_set(&cls->lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void class_unlock(slab_class_t *cls) {
+    __atomic_clear(&cls->lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * smallest class holding size bytes, or -1 if none does
+ */
+static int class_of(size_t size) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        if (size <= class_size[i]) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * allocate size bytes, aligned to 16
+ * sizes above the largest class fall back to malloc
+ * return NULL if out of memory
+ */
+void *slab_alloc(size_t size) {
+    int c = class_of(size);
+    if (c < 0) {
+        return malloc(size);
+    }
+
+    slab_class_t *cls = &classes[c];
+    size_t slot_size = class_size[c];
+    void *ptr;
+
+    class_lock(cls);
+    if (cls->free) {
+        ptr = cls->free;
+        cls->free = cls->free->next;
+    } else {
+        if ((size_t)(cls->end - cls->bump) < slot_size) {
+            // the tail of the old region is too small for a slot, left over
+            char *region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (region == MAP_FAILED) {
+                class_unlock(cls);
+                return NULL;
+            }
+            cls->bump = region;
+            cls->end = region + SLAB_REGION_SIZE;
+            cls->mapped += SLAB_REGION_SIZE;
+        }
+        ptr = cls->bump;
+        cls->bump += slot_size;
+    }
+    cls->slots++;
+    cls->requested += size;
+    class_unlock(cls);
+    return ptr;
+}
+
+/*
+ * give back ptr, size must be what it was allocated with
+ */
+void slab_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    int c = class_of(size);
+    if (c < 0) {
+        free(ptr);
+        return;
+    }
+
+    slab_class_t *cls = &classes[c];
+    slot_t *slot = ptr;
+    class_lock(cls);
+    slot->next = cls->free;
+    cls->free = slot;
+    cls->slots--;
+    cls->requested -= size;
+    class_unlock(cls);
+}
+
+/*
+ * copy of the current byte counts
+ */
+void slab_stats(slab_stats_t *stats) {
+    stats->mapped = 0;
+    stats->in_use = 0;
+    stats->requested = 0;
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        slab_class_t *cls = &classes[i];
+        class_lock(cls);
+        stats->mapped += cls->mapped;
+        stats->in_use += cls->slots * class_size[i];
+        stats->requested += cls->requested;
+        class_unlock(cls);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Size-classed slab arena for the cache's long-lived memory.
+ *
+ * Every request is rounded up to one of a fixed set of slot sizes, and
+ * slots of one size are carved from large mmap'd regions that only ever
+ * hold slots of that size. A freed slot goes on its class's free list and
+ * is handed out again before the region is touched further, so churn
+ * between objects of different sizes cannot fragment the memory of
+ * another class. Regions are never returned to the system; the cache's
+ * byte budget bounds how many of them are ever needed.
+ */
+
+/* byte counts over all classes */
+typedef struct {
+    size_t mapped;    // regions taken from the system
+    size_t in_use;    // slots handed out, at their slot size
+    size_t requested; // what callers asked for in those slots
+} slab_stats_t;
+
+/*
+ * allocate size bytes, aligned to 16
+ * sizes above the largest class fall back to malloc
+ * return NULL if out of memory
+ */
+void *slab_alloc(size_t size);
+
+/*
+ * give back ptr, size must be what it was allocated with
+ */
+void slab_free(void *ptr, size_t size);
+
+/*
+ * copy of the current byte counts
+ */
+void slab_stats(slab_stats_t *stats);
+
+#endif
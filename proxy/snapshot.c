@@ -0,0 +1,228 @@
+/*
+ * snapshot.c - saving the cache to a file and warming it up from one
+ *
+ * A snapshot is a header followed by one record per object, each a
+ * snapshot_record_t, the key with its NUL and the object's record as
+ * cache_obj_record gives it, padded to SNAPSHOT_ALIGN. The checksum is
+ * 64-bit FNV-1a over the key and the data, enough to catch a truncated or
+ * damaged file, which is all it has to.
+ */
+#include "snapshot.h"
+#include "cache.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_ALIGN 8
+#define SNAPSHOT_MAGIC "PXYSNAP1"
+#define SNAPSHOT_RECORD_MAGIC 0x70787973 // "pxys"
+#define SNAPSHOT_TMP ".tmp"
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+typedef struct {
+    uint32_t magic;
+    uint32_t key_len; // with the NUL
+    uint64_t data_len;
+    uint64_t checksum;
+} snapshot_record_t;
+
+static struct {
+    const char *path;
+    sigset_t signals; // that write a snapshot, waited for by one thread
+} snapshot;
+
+static uint64_t checksum_add(uint64_t sum, const void *buf, size_t len) {
+    for (const unsigned char *p = buf; len > 0; p++, len--) {
+        sum ^= *p;
+        sum *= 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+static size_t padding(size_t len) {
+    return (SNAPSHOT_ALIGN - len % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+}
+
+/*
+ * append the record of obj to fp
+ * return false on a write error
+ */
+static bool save_obj(FILE *fp, const cache_obj_t *obj) {
+    static const char zeros[SNAPSHOT_ALIGN];
+    cache_record_t rec;
+    struct iovec iov[CACHE_RECORD_IOVS];
+    int iovcnt = cache_obj_record(obj, &rec, iov);
+
+    snapshot_record_t head = {.magic = SNAPSHOT_RECORD_MAGIC,
+                              .key_len = (uint32_t)strlen(obj->key) + 1,
+                              .data_len = 0};
+    head.checksum = checksum_add(CHECKSUM_INIT, obj->key, head.key_len);
+    for (int i = 0; i < iovcnt; i++) {
+        head.data_len += iov[i].iov_len;
+        head.checksum =
+            checksum_add(head.checksum, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    if (fwrite(&head, sizeof(head), 1, fp) != 1 ||
+        fwrite(obj->key, head.key_len, 1, fp) != 1) {
+        return false;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (fwrite(iov[i].iov_base, iov[i].iov_len, 1, fp) != 1) {
+            return false;
+        }
+    }
+    size_t pad = padding(head.key_len + head.data_len);
+    return pad == 0 || fwrite(zeros, pad, 1, fp) == 1;
+}
+
+bool snapshot_save(const char *path) {
+    size_t len = strlen(path) + sizeof(SNAPSHOT_TMP);
+    char *tmp = malloc(len);
+    if (!tmp) {
+        return false;
+    }
+    snprintf(tmp, len, "%s%s", path, SNAPSHOT_TMP);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        free(tmp);
+        return false;
+    }
+
+    size_t n;
+    cache_obj_t **objs = cache_objects(&n);
+    bool ok = fwrite(SNAPSHOT_MAGIC, 8, 1, fp) == 1;
+    for (size_t i = 0; i < n; i++) {
+        ok = ok && save_obj(fp, objs[i]);
+        free_cache_obj(objs[i]);
+    }
+    free(objs);
+
+    ok = fflush(fp) == 0 && ok;
+    ok = ok && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+/*
+ * put the objects of the snapshot at snapshot.path back in the cache
+ */
+static void *loader(void *vargp) {
+    (void)vargp;
+    int fd = open(snapshot.path, O_RDONLY);
+    if (fd < 0) {
+        return NULL; // nothing saved yet
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < 8) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    size_t pos = 8;
+    size_t restored = 0;
+    bool intact = !memcmp(map, SNAPSHOT_MAGIC, 8);
+    while (intact && pos < size) {
+        snapshot_record_t head;
+        if (size - pos < sizeof(head)) {
+            intact = false;
+            break;
+        }
+        memcpy(&head, map + pos, sizeof(head));
+        pos += sizeof(head);
+        if (head.magic != SNAPSHOT_RECORD_MAGIC || head.key_len == 0 ||
+            head.key_len > size - pos ||
+            head.data_len > size - pos - head.key_len) {
+            intact = false;
+            break;
+        }
+        const char *key = map + pos;
+        const char *data = key + head.key_len;
+        if (key[head.key_len - 1] != '\0' ||
+            checksum_add(checksum_add(CHECKSUM_INIT, key, head.key_len), data,
+                         head.data_len) != head.checksum) {
+            intact = false;
+            break;
+        }
+        pos += head.key_len + head.data_len;
+        pos += padding(head.key_len + head.data_len);
+
+        cache_obj_t *obj = cache_obj_from_record(key, data, head.data_len);
+        if (obj) {
+            cache_restore(obj);
+            restored++;
+        }
+    }
+    munmap(map, size);
+    if (!intact) {
+        fprintf(stderr, "snapshot %s damaged, loading stopped\n",
+                snapshot.path);
+    }
+    fprintf(stderr, "restored %zu objects from %s\n", restored,
+            snapshot.path);
+    return NULL;
+}
+
+/*
+ * write a snapshot on every signal in snapshot.signals, and exit after
+ * one that asks the proxy to stop
+ */
+static void *signal_waiter(void *vargp) {
+    (void)vargp;
+    while (1) {
+        int sig;
+        if (sigwait(&snapshot.signals, &sig) != 0) {
+            continue;
+        }
+        if (!snapshot_save(snapshot.path)) {
+            fprintf(stderr, "could not write the snapshot %s\n",
+                    snapshot.path);
+        }
+        if (sig != SIGUSR1) {
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+bool snapshot_start(const char *path) {
+    pthread_t tid;
+
+    snapshot.path = path;
+    sigemptyset(&snapshot.signals);
+    sigaddset(&snapshot.signals, SIGUSR1);
+    sigaddset(&snapshot.signals, SIGTERM);
+    sigaddset(&snapshot.signals, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &snapshot.signals, NULL) != 0) {
+        return false;
+    }
+    if (pthread_create(&tid, NULL, signal_waiter, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(tid);
+    if (pthread_create(&tid, NULL, loader, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+
+/*
+ * Snapshot of the cache in a file, enabled with "./proxy -p file <port>".
+ *
+ * The cache is written to the file on SIGUSR1, and on SIGTERM or SIGINT
+ * before the proxy exits. A new snapshot goes to file.tmp first and is
+ * renamed over the old one once complete, so a crash half way leaves the
+ * last good one. At startup the file is mapped and a loader thread puts
+ * its objects back in the cache while the proxy already serves, so the
+ * listener never waits for it. Every record carries a checksum, and
+ * loading stops at the first one that does not match.
+ */
+
+/*
+ * load the snapshot at path, if there is one, in the background, and
+ * write it there on SIGUSR1 and at shutdown from now on; must be called
+ * before any other thread starts, as they all leave these signals to the
+ * one waiting for them
+ * return false on failure
+ */
+bool snapshot_start(const char *path);
+
+/*
+ * write the cache to the snapshot at path now
+ * return false on failure, the old snapshot is then left as it was
+ */
+bool snapshot_save(const char *path);
+
+#endif
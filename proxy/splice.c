@@ -0,0 +1,116 @@
+/*
+ * splice.c - zero-copy relay between sockets
+ *
+ * A relay alternates between filling the pipe from the input socket and
+ * draining all of it into the output socket, so the pipe is empty again
+ * whenever a relay returns, except after the output failed: the pipe
+ * then still holds bytes nobody wants and is closed, and the thread gets
+ * a new one next time.
+ */
+#define _GNU_SOURCE
+
+#include "splice.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    int fds[2]; // read end, write end
+} splice_pipe_t;
+
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+static __thread splice_pipe_t *self;
+
+static void pipe_close(splice_pipe_t *p) {
+    close(p->fds[0]);
+    close(p->fds[1]);
+    free(p);
+}
+
+/*
+ * thread exit: close its pipe
+ */
+static void pipe_release(void *vpipe) {
+    pipe_close(vpipe);
+}
+
+static void pipe_key_init(void) {
+    if (pthread_key_create(&pipe_key, pipe_release) != 0) {
+        fprintf(stderr, "splice: could not create thread key\n");
+        exit(1);
+    }
+}
+
+bool splice_ready(void) {
+    if (self) {
+        return true;
+    }
+    pthread_once(&pipe_once, pipe_key_init);
+
+    splice_pipe_t *p = malloc(sizeof(splice_pipe_t));
+    if (!p) {
+        return false;
+    }
+    if (pipe2(p->fds, O_CLOEXEC) != 0) {
+        free(p);
+        return false;
+    }
+    // the default 64 KB would take a pair of splices every 16 pages;
+    // keep the default if the limit for unprivileged pipes is lower
+    fcntl(p->fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pthread_setspecific(pipe_key, p) != 0) {
+        pipe_close(p);
+        return false;
+    }
+    self = p;
+    return true;
+}
+
+/*
+ * drop this thread's pipe, which holds bytes that will never be drained
+ */
+static void pipe_discard(void) {
+    pthread_setspecific(pipe_key, NULL);
+    pipe_close(self);
+    self = NULL;
+}
+
+splice_result_t splice_relay(int in, int out, long long len) {
+    while (len != 0) {
+        size_t want = len < 0 || len > SPLICE_PIPE_SIZE ? SPLICE_PIPE_SIZE
+                                                        : (size_t)len;
+        ssize_t n = splice(in, NULL, self->fds[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return SPLICE_IN_FAILED;
+        }
+        if (n == 0) {
+            return len < 0 ? SPLICE_DONE : SPLICE_IN_FAILED;
+        }
+        if (len > 0) {
+            len -= n;
+        }
+
+        while (n > 0) {
+            ssize_t m = splice(self->fds[0], NULL, out, NULL, (size_t)n,
+                               SPLICE_F_MOVE | (len != 0 ? SPLICE_F_MORE : 0));
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                pipe_discard();
+                return SPLICE_OUT_FAILED;
+            }
+            n -= m;
+        }
+    }
+    return SPLICE_DONE;
+}
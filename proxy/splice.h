@@ -0,0 +1,37 @@
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include <stdbool.h>
+
+/*
+ * Zero-copy relay from one socket to another with splice(2).
+ *
+ * Bytes go from the end server's socket into a pipe and from the pipe
+ * into the client's socket, moved between kernel buffers without ever
+ * being copied into the proxy. It only pays off for responses the proxy
+ * does not look at, which are ones it will not cache. Every thread keeps
+ * one pipe of SPLICE_PIPE_SIZE bytes, made the first time it splices and
+ * closed when the thread exits.
+ */
+#define SPLICE_PIPE_SIZE (256 * 1024)
+
+typedef enum {
+    SPLICE_DONE,       // all of it was moved
+    SPLICE_IN_FAILED,  // the end server closed or failed first
+    SPLICE_OUT_FAILED, // the client went away
+} splice_result_t;
+
+/*
+ * set up this thread's pipe if it has none yet
+ * return false if it cannot splice, the caller then copies instead
+ */
+bool splice_ready(void);
+
+/*
+ * move len bytes from socket in to socket out, or up to EOF if len is
+ * negative, which then counts as SPLICE_DONE; splice_ready() must have
+ * returned true
+ */
+splice_result_t splice_relay(int in, int out, long long len);
+
+#endif
@@ -0,0 +1,30 @@
+# Concurrent misses on the same file while the first one is still
+# being fetched.  A proxy that coalesces them ("-c") sends only the
+# first request to the server, the others get its response too.
+serve s1
+generate random-text00.txt 50K
+generate random-binary01.bin 300K
+request r00a random-text00.txt s1
+wait *
+fetch f00b random-text00.txt s1
+fetch f00c random-text00.txt s1
+respond r00a
+wait *
+check r00a
+check f00b
+check f00c
+# Too big to cache, but still shared while in flight
+request r01a random-binary01.bin s1
+wait *
+fetch f01b random-binary01.bin s1
+respond r01a
+wait *
+check r01a
+check f01b
+# Fetched once, now cached
+fetch f00d random-text00.txt s1
+wait *
+check f00d
+delete random-text00.txt
+delete random-binary01.bin
+quit
@@ -0,0 +1,560 @@
+/*
+ * tunnel.c - CONNECT tunnels relayed by one epoll loop
+ *
+ * Tunnels are handed over to the loop through a list and an eventfd, and
+ * from then on only the loop thread touches them. Sockets are watched
+ * level-triggered, and each only for what can be done right away: a side
+ * is read while the other side took everything read from it before, and
+ * written while bytes for it were kept aside. A side wanted for neither
+ * is not watched at all, so a peer that hung up cannot wake the loop over
+ * and over while its tunnel waits on the other side. Tunnels are kept in
+ * order of when they last moved bytes, so the idle ones are found at the
+ * front of that list.
+ */
+#define _GNU_SOURCE
+
+#include "tunnel.h"
+#include "http.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TUNNEL_MAX_EVENTS 256
+#define TUNNEL_TICK_MS 1000 // how often idle tunnels are looked for
+
+static const char established[] = "HTTP/1.1 200 Connection established\r\n"
+                                  "\r\n";
+
+typedef struct tunnel tunnel_t;
+
+/* one socket of a tunnel, as registered with epoll */
+typedef struct {
+    int fd;
+    uint32_t events; // watched for, 0 if not registered
+    tunnel_t *t;
+} side_t;
+
+/* bytes on their way from one side to the other */
+typedef struct {
+    char *buf; // what the receiving side could not take yet, or NULL
+    size_t len;
+    size_t off;
+    bool eof;         // the sending side is done, the other was told
+    long long *total; // counter in the stats its bytes add to
+} flow_t;
+
+struct tunnel {
+    side_t client;
+    side_t server;
+    flow_t up;   // client to end server
+    flow_t down; // end server to client
+    bool connected;
+    bool closed;
+    dns_result_t *addrs; // end server addresses, while connecting
+    int next_addr;       // next one to try connecting to
+    time_t active;       // when bytes last moved, or it was opened
+    // in the loop's list, least recently active first; the handover
+    // and closed lists are linked by next too
+    tunnel_t *prev;
+    tunnel_t *next;
+};
+
+static struct {
+    pthread_once_t once;
+    int epfd;
+    int wakefd;         // eventfd written when tunnels are handed over
+    pthread_mutex_t mutex; // protects incoming
+    tunnel_t *incoming; // handed over, not taken by the loop yet
+    tunnel_t *head;
+    tunnel_t *tail;
+    tunnel_t *closed; // freed after the current batch of events
+    tunnel_stats_t stats;
+    char buf[TUNNEL_BUFSIZE];
+} loop = {
+    .once = PTHREAD_ONCE_INIT,
+    .epfd = -1,
+    .wakefd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void stat_add(long long *counter, long long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void list_remove(tunnel_t *t) {
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        loop.head = t->next;
+    }
+    if (t->next) {
+        t->next->prev = t->prev;
+    } else {
+        loop.tail = t->prev;
+    }
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+static void list_append(tunnel_t *t) {
+    t->prev = loop.tail;
+    t->next = NULL;
+    if (loop.tail) {
+        loop.tail->next = t;
+    } else {
+        loop.head = t;
+    }
+    loop.tail = t;
+}
+
+/*
+ * note that t moved bytes, which puts it last in line to time out
+ */
+static void tunnel_touch(tunnel_t *t, time_t now) {
+    t->active = now;
+    if (loop.tail != t) {
+        list_remove(t);
+        list_append(t);
+    }
+}
+
+/*
+ * watch s for events, or stop watching it if there are none
+ * return false on failure
+ */
+static bool side_watch(side_t *s, uint32_t events) {
+    if (s->events == events) {
+        return true;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = s;
+    int op = events == 0     ? EPOLL_CTL_DEL
+             : s->events == 0 ? EPOLL_CTL_ADD
+                              : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop.epfd, op, s->fd, &ev) < 0) {
+        return false;
+    }
+    s->events = events;
+    return true;
+}
+
+/*
+ * close s, dropping it from the epoll set first: the client's socket is
+ * a duplicate, which closing alone would leave registered
+ */
+static void side_close(side_t *s) {
+    if (s->fd < 0) {
+        return;
+    }
+    side_watch(s, 0);
+    close(s->fd);
+    s->fd = -1;
+}
+
+/*
+ * watch each side for what can be done with it right now
+ * return false on failure
+ */
+static bool tunnel_watch(tunnel_t *t) {
+    uint32_t client = 0;
+    uint32_t server = 0;
+
+    if (!t->connected) {
+        server = EPOLLOUT;
+    } else {
+        if (!t->up.buf && !t->up.eof) {
+            client |= EPOLLIN;
+        }
+        if (!t->down.buf && !t->down.eof) {
+            server |= EPOLLIN;
+        }
+        if (t->up.buf) {
+            server |= EPOLLOUT;
+        }
+        if (t->down.buf) {
+            client |= EPOLLOUT;
+        }
+    }
+    return side_watch(&t->client, client) && side_watch(&t->server, server);
+}
+
+/*
+ * close both sockets and release everything but the tunnel itself, which
+ * may still be referenced by events later in the same batch
+ */
+static void tunnel_close(tunnel_t *t) {
+    if (t->closed) {
+        return;
+    }
+    t->closed = true;
+
+    side_close(&t->client);
+    side_close(&t->server);
+    free(t->up.buf);
+    free(t->down.buf);
+    free(t->addrs);
+    list_remove(t);
+    stat_add(&loop.stats.active, -1);
+
+    t->next = loop.closed;
+    loop.closed = t;
+}
+
+/*
+ * no address of the end server took the connection: tell the client so
+ * and close the tunnel
+ */
+static void tunnel_fail(tunnel_t *t) {
+    char buf[MAXLINE + MAXBUF];
+    size_t len = http_format_error(buf, sizeof(buf), "502", "Bad Gateway",
+                                   "Proxy could not connect to the end "
+                                   "server");
+    // the client waits for nothing else, one try is enough
+    if (len > 0) {
+        send(t->client.fd, buf, len, MSG_NOSIGNAL);
+    }
+    stat_add(&loop.stats.failed, 1);
+    tunnel_close(t);
+}
+
+/*
+ * start connecting to the next address of the end server
+ * return false if none is left
+ */
+static bool tunnel_connect_next(tunnel_t *t) {
+    while (t->next_addr < t->addrs->naddrs) {
+        dns_addr_t *p = &t->addrs->addrs[t->next_addr++];
+
+        int fd =
+            socket(p->family, p->socktype | SOCK_NONBLOCK, p->protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int rc = connect(fd, (struct sockaddr *)&p->addr, p->addrlen);
+        if (rc < 0 && errno != EINPROGRESS) {
+            close(fd);
+            continue;
+        }
+        t->server.fd = fd;
+        t->server.events = 0;
+        if (!tunnel_watch(t)) {
+            close(fd);
+            t->server.fd = -1;
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * send the n bytes at data to fd, keeping in f what it cannot take yet
+ * return false on failure
+ */
+static bool flow_send(flow_t *f, int fd, const char *data, size_t n) {
+    ssize_t m = send(fd, data, n, MSG_NOSIGNAL);
+    if (m < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return false;
+        }
+        m = 0;
+    }
+    if ((size_t)m == n) {
+        return true;
+    }
+    f->buf = malloc(n - (size_t)m);
+    if (!f->buf) {
+        return false;
+    }
+    memcpy(f->buf, data + m, n - (size_t)m);
+    f->len = n - (size_t)m;
+    f->off = 0;
+    return true;
+}
+
+/*
+ * move f's bytes on from one side to the other: the ones kept aside if
+ * there are any, else one read's worth, or its EOF
+ * return -1 on failure, else whether anything moved
+ */
+static int flow_pump(flow_t *f, side_t *from, side_t *to) {
+    if (f->buf) {
+        ssize_t m =
+            send(to->fd, f->buf + f->off, f->len - f->off, MSG_NOSIGNAL);
+        if (m < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                       ? 0
+                       : -1;
+        }
+        f->off += (size_t)m;
+        if (f->off == f->len) {
+            free(f->buf);
+            f->buf = NULL;
+        }
+        return 1;
+    }
+    if (f->eof) {
+        return 0;
+    }
+
+    ssize_t n = recv(from->fd, loop.buf, sizeof(loop.buf), 0);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0
+                                                                         : -1;
+    }
+    if (n == 0) {
+        // pass the half close on, the other way may still have more
+        f->eof = true;
+        shutdown(to->fd, SHUT_WR);
+        return 1;
+    }
+    stat_add(f->total, n);
+    return flow_send(f, to->fd, loop.buf, (size_t)n) ? 1 : -1;
+}
+
+/*
+ * the connection to the end server completed or failed
+ */
+static void tunnel_connected(tunnel_t *t, time_t now) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(t->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err != 0) {
+        side_close(&t->server);
+        if (!tunnel_connect_next(t)) {
+            tunnel_fail(t);
+        }
+        return;
+    }
+
+    t->connected = true;
+    free(t->addrs);
+    t->addrs = NULL;
+    // whatever the client sent early waits in up until the server is
+    // watched for writing
+    if (!flow_send(&t->down, t->client.fd, established,
+                   sizeof(established) - 1) ||
+        !tunnel_watch(t)) {
+        tunnel_close(t);
+        return;
+    }
+    tunnel_touch(t, now);
+}
+
+static void tunnel_event(side_t *s, uint32_t events, time_t now) {
+    tunnel_t *t = s->t;
+
+    // only the server is watched until it is connected
+    if (!t->connected) {
+        tunnel_connected(t, now);
+        return;
+    }
+
+    // a flow moves when its sending side can be read or its receiving
+    // side written
+    uint32_t in = EPOLLIN | EPOLLHUP | EPOLLERR;
+    uint32_t out = EPOLLOUT | EPOLLHUP | EPOLLERR;
+    bool client = s == &t->client;
+    int up = 0;
+    int down = 0;
+    if (events & (client ? in : out)) {
+        up = flow_pump(&t->up, &t->client, &t->server);
+    }
+    if (up >= 0 && events & (client ? out : in)) {
+        down = flow_pump(&t->down, &t->server, &t->client);
+    }
+    if (up < 0 || down < 0 ||
+        (t->up.eof && t->down.eof && !t->up.buf && !t->down.buf)) {
+        tunnel_close(t);
+        return;
+    }
+    if (up || down) {
+        tunnel_touch(t, now);
+    }
+    if (!tunnel_watch(t)) {
+        tunnel_close(t);
+    }
+}
+
+/*
+ * take over the tunnels handed to the loop and start connecting them
+ */
+static void loop_take(time_t now) {
+    eventfd_t count;
+    eventfd_read(loop.wakefd, &count);
+
+    pthread_mutex_lock(&loop.mutex);
+    tunnel_t *t = loop.incoming;
+    loop.incoming = NULL;
+    pthread_mutex_unlock(&loop.mutex);
+
+    while (t) {
+        tunnel_t *next = t->next;
+        t->active = now;
+        list_append(t);
+        if (!tunnel_connect_next(t)) {
+            tunnel_fail(t);
+        }
+        t = next;
+    }
+}
+
+/*
+ * close the tunnels that moved nothing for TUNNEL_IDLE_TIMEOUT seconds
+ */
+static void loop_expire(time_t now) {
+    while (loop.head && now - loop.head->active >= TUNNEL_IDLE_TIMEOUT) {
+        tunnel_t *t = loop.head;
+        stat_add(&loop.stats.timeouts, 1);
+        if (t->connected) {
+            tunnel_close(t);
+        } else {
+            tunnel_fail(t);
+        }
+    }
+}
+
+static void *loop_run(void *vargp) {
+    struct epoll_event events[TUNNEL_MAX_EVENTS];
+    (void)vargp;
+
+    while (1) {
+        int n = epoll_wait(loop.epfd, events, TUNNEL_MAX_EVENTS,
+                           loop.head ? TUNNEL_TICK_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("tunnel: epoll_wait");
+            exit(1);
+        }
+
+        time_t now = time(NULL);
+        for (int i = 0; i < n; i++) {
+            side_t *s = events[i].data.ptr;
+            if (!s) {
+                loop_take(now);
+            } else if (!s->t->closed) {
+                tunnel_event(s, events[i].events, now);
+            }
+        }
+        loop_expire(now);
+
+        while (loop.closed) {
+            tunnel_t *t = loop.closed;
+            loop.closed = t->next;
+            free(t);
+        }
+    }
+    return NULL;
+}
+
+static void loop_start(void) {
+    struct epoll_event ev;
+    pthread_t tid;
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (loop.epfd < 0 || loop.wakefd < 0 ||
+        epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wakefd, &ev) < 0 ||
+        pthread_create(&tid, NULL, loop_run, NULL) != 0) {
+        fprintf(stderr, "tunnel: could not start the loop\n");
+        if (loop.epfd >= 0) {
+            close(loop.epfd);
+        }
+        loop.epfd = -1;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static void tunnel_free(tunnel_t *t) {
+    if (t->client.fd >= 0) {
+        close(t->client.fd);
+    }
+    free(t->up.buf);
+    free(t->addrs);
+    free(t);
+}
+
+bool tunnel_open(int clientfd, const dns_result_t *addrs, const char *early,
+                 size_t early_len) {
+    pthread_once(&loop.once, loop_start);
+    if (loop.epfd < 0 || addrs->naddrs == 0) {
+        return false;
+    }
+
+    tunnel_t *t = calloc(1, sizeof(tunnel_t));
+    if (!t) {
+        return false;
+    }
+    t->client.fd = -1;
+    t->client.t = t;
+    t->server.fd = -1;
+    t->server.t = t;
+    t->up.total = &loop.stats.bytes_up;
+    t->down.total = &loop.stats.bytes_down;
+    t->addrs = malloc(sizeof(dns_result_t));
+    if (!t->addrs) {
+        tunnel_free(t);
+        return false;
+    }
+    *t->addrs = *addrs;
+    if (early_len > 0) {
+        t->up.buf = malloc(early_len);
+        if (!t->up.buf) {
+            tunnel_free(t);
+            return false;
+        }
+        memcpy(t->up.buf, early, early_len);
+        t->up.len = early_len;
+        stat_add(t->up.total, (long long)early_len);
+    }
+    t->client.fd = fcntl(clientfd, F_DUPFD_CLOEXEC, 0);
+    if (t->client.fd < 0 || set_nonblocking(t->client.fd) < 0) {
+        tunnel_free(t);
+        return false;
+    }
+    stat_add(&loop.stats.opened, 1);
+    stat_add(&loop.stats.active, 1);
+
+    pthread_mutex_lock(&loop.mutex);
+    t->next = loop.incoming;
+    loop.incoming = t;
+    pthread_mutex_unlock(&loop.mutex);
+    eventfd_write(loop.wakefd, 1);
+    return true;
+}
+
+void tunnel_stats(tunnel_stats_t *stats) {
+    stats->opened = __atomic_load_n(&loop.stats.opened, __ATOMIC_RELAXED);
+    stats->active = __atomic_load_n(&loop.stats.active, __ATOMIC_RELAXED);
+    stats->failed = __atomic_load_n(&loop.stats.failed, __ATOMIC_RELAXED);
+    stats->timeouts =
+        __atomic_load_n(&loop.stats.timeouts, __ATOMIC_RELAXED);
+    stats->bytes_up =
+        __atomic_load_n(&loop.stats.bytes_up, __ATOMIC_RELAXED);
+    stats->bytes_down =
+        __atomic_load_n(&loop.stats.bytes_down, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,54 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include "dns.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Tunnels opened with "CONNECT host:port", which is how HTTPS goes
+ * through the proxy.
+ *
+ * Once the end server accepts the connection, the client is told
+ * "200 Connection established" and from then on bytes are moved both
+ * ways without being looked at. Every engine hands its tunnels over to
+ * one epoll loop thread, started with the first of them, so that a
+ * tunnel costs its two sockets and a small struct rather than a thread
+ * or a buffer: whatever is read from one side goes straight out to the
+ * other from the loop's own buffer, and only what that side cannot take
+ * yet is copied aside, which also stops reading more until it is sent.
+ * A tunnel that moves nothing either way for TUNNEL_IDLE_TIMEOUT
+ * seconds is closed.
+ */
+#define TUNNEL_IDLE_TIMEOUT 300
+#define TUNNEL_BUFSIZE (64 * 1024) // most read at once from one side
+
+/* tunnels since the start */
+typedef struct {
+    long long opened;
+    long long active;     // opened and not closed yet
+    long long failed;     // no address of the end server could be reached
+    long long timeouts;   // closed for being idle
+    long long bytes_up;   // from clients to end servers
+    long long bytes_down; // from end servers to clients
+} tunnel_stats_t;
+
+/*
+ * open a tunnel from the client on clientfd to the first of addrs that
+ * accepts a connection, sending it the early_len bytes at early first,
+ * which the client sent after its CONNECT header
+ * the tunnel works on a duplicate of clientfd: the caller still closes
+ * its own, after taking it out of any epoll set of its own
+ * return false if it could not be set up, the client was then told
+ * nothing yet
+ */
+bool tunnel_open(int clientfd, const dns_result_t *addrs, const char *early,
+                 size_t early_len);
+
+/*
+ * copy of the counters
+ */
+void tunnel_stats(tunnel_stats_t *stats);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * upstream.c - pool of idle keep-alive connections to end servers
+ *
+ * Idle connections hang off a small hash table keyed by "host:port", the
+ * most recently released first, so the connection least likely to have
+ * been timed out by its server is reused first. Expired ones are pruned
+ * whenever a bucket is visited. The lock only guards the lists: sockets
+ * are checked and closed after dropping it.
+ */
+#include "upstream.h"
+#include "csapp.h"
+#include "dns.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UPSTREAM_BUCKETS 64
+
+typedef struct idle_conn {
+    struct idle_conn *next;
+    int fd;
+    time_t since; // when it was released
+    char key[];   // host:port
+} idle_conn_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    int count; // idle connections in all buckets
+    idle_conn_t *buckets[UPSTREAM_BUCKETS];
+} upstream = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * FNV-1a, as for the cache index
+ */
+static idle_conn_t **bucket_of(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return &upstream.buckets[hash % UPSTREAM_BUCKETS];
+}
+
+/*
+ * move the connections of bucket idle for too long to *expired
+ * must hold upstream.mutex
+ */
+static void prune_bucket(idle_conn_t **bucket, time_t now,
+                         idle_conn_t **expired) {
+    idle_conn_t **pp = bucket;
+    while (*pp) {
+        idle_conn_t *conn = *pp;
+        if (now - conn->since >= UPSTREAM_IDLE_TIMEOUT) {
+            *pp = conn->next;
+            conn->next = *expired;
+            *expired = conn;
+            upstream.count--;
+        } else {
+            pp = &conn->next;
+        }
+    }
+}
+
+static void close_conns(idle_conn_t *conn) {
+    while (conn) {
+        idle_conn_t *next = conn->next;
+        close(conn->fd);
+        free(conn);
+        conn = next;
+    }
+}
+
+/*
+ * an idle connection must have nothing to read: data or EOF means the
+ * server closed it or broke the protocol
+ */
+static bool still_idle(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * an idle connection to host:port from the pool, or a new one
+ * sets *reused for a pooled one, which the server may still have closed
+ * return -1 if no connection could be opened
+ */
+int upstream_open(const char *host, const char *port, bool *reused) {
+    char key[MAXLINE];
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    idle_conn_t **bucket = bucket_of(key);
+
+    while (1) {
+        idle_conn_t *expired = NULL;
+        idle_conn_t *found = NULL;
+
+        pthread_mutex_lock(&upstream.mutex);
+        prune_bucket(bucket, now_sec(), &expired);
+        for (idle_conn_t **pp = bucket; *pp; pp = &(*pp)->next) {
+            if (!strcmp((*pp)->key, key)) {
+                found = *pp;
+                *pp = found->next;
+                upstream.count--;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&upstream.mutex);
+        close_conns(expired);
+
+        if (!found) {
+            break;
+        }
+        int fd = found->fd;
+        free(found);
+        if (still_idle(fd)) {
+            *reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *reused = false;
+    return dns_open_clientfd(host, port);
+}
+
+/*
+ * give back a connection whose last response was read to its end
+ * it is closed instead if the pool is full
+ */
+void upstream_release(const char *host, const char *port, int fd) {
+    size_t key_len = strlen(host) + 1 + strlen(port);
+    idle_conn_t *conn = malloc(sizeof(idle_conn_t) + key_len + 1);
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    snprintf(conn->key, key_len + 1, "%s:%s", host, port);
+    conn->fd = fd;
+    conn->since = now_sec();
+
+    idle_conn_t **bucket = bucket_of(conn->key);
+    idle_conn_t *expired = NULL;
+    int per_host = 0;
+
+    pthread_mutex_lock(&upstream.mutex);
+    if (upstream.count >= UPSTREAM_MAX_IDLE) {
+        // make room from servers nobody asked for in a while
+        for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+            prune_bucket(&upstream.buckets[i], conn->since, &expired);
+        }
+    } else {
+        prune_bucket(bucket, conn->since, &expired);
+    }
+    for (idle_conn_t *curr = *bucket; curr; curr = curr->next) {
+        if (!strcmp(curr->key, conn->key)) {
+            per_host++;
+        }
+    }
+    if (upstream.count < UPSTREAM_MAX_IDLE &&
+        per_host < UPSTREAM_MAX_PER_HOST) {
+        conn->next = *bucket;
+        *bucket = conn;
+        upstream.count++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&upstream.mutex);
+
+    close_conns(expired);
+    if (conn) {
+        close(conn->fd);
+        free(conn);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdbool.h>
+
+/*
+ * Pool of idle persistent connections to end servers, keyed by host and
+ * port.
+ *
+ * A fetch takes a connection with upstream_open() and, if the response
+ * was read to its end and the server allows it, hands it back with
+ * upstream_release() for the next request to the same server. Idle
+ * connections are closed after UPSTREAM_IDLE_TIMEOUT seconds, and at most
+ * UPSTREAM_MAX_PER_HOST of them per server and UPSTREAM_MAX_IDLE in all
+ * are kept.
+ */
+#define UPSTREAM_IDLE_TIMEOUT 15
+#define UPSTREAM_MAX_PER_HOST 8
+#define UPSTREAM_MAX_IDLE 64
+
+/*
+ * an idle connection to host:port from the pool, or a new one
+ * sets *reused for a pooled one, which the server may still have closed
+ * return -1 if no connection could be opened
+ */
+int upstream_open(const char *host, const char *port, bool *reused);
+
+/*
+ * give back a connection whose last response was read to its end
+ * it is closed instead if the pool is full
+ */
+void upstream_release(const char *host, const char *port, int fd);
+
+#endif
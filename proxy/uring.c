@@ -0,0 +1,896 @@
+/*
+ * uring.c - io_uring engine
+ *
+ * Connections go through the same states as in the epoll engine (see
+ * event.c), but are driven by completions instead of readiness: every
+ * step submits one operation and the next step runs once it completed,
+ * so a connection has a single operation in flight, plus notifications
+ * of zero-copy sends whose buffers the kernel still holds. Submissions
+ * are flushed by the io_uring_enter that waits for the next completions,
+ * so a whole batch of steps costs one system call.
+ *
+ * Each loop thread sets its ring up with the raw system calls:
+ *   - one multishot accept on the loop's listening socket reports every
+ *     new connection as a completion of its own; on a shared socket the
+ *     first loop woken takes all that are waiting, so -R spreads them
+ *   - response bytes are received into buffers the loop provides in a
+ *     ring, picked by the kernel only once data arrived, and sent on to
+ *     the client straight from there
+ *   - connecting to the end server is linked with sending it the
+ *     request, one submission for both
+ *   - large cache hits go out with a zero-copy sendmsg from the object's
+ *     segments, which stay referenced until the kernel is done with them
+ * Kernels without provided buffer rings (before 5.19) make uring_run fail,
+ * and the proxy falls back to epoll; without zero-copy sends (before 6.1)
+ * hits are sent with a plain sendmsg.
+ */
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "cache.h"
+#include "csapp.h"
+#include "dns.h"
+#include "http.h"
+#include "refresh.h"
+#include "tunnel.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// the opcodes are enumerators, so check for a macro of the same headers
+// (6.2) instead
+#ifdef IORING_SEND_ZC_REPORT_USAGE
+
+#define URING_ENTRIES 256
+#define URING_BUFS 256 // provided buffers per loop, a power of two
+#define URING_BUF_SIZE MAXBUF
+#define URING_BGID 0
+// smaller hits are cheaper to copy than to pin and get notified about
+#define URING_ZC_MIN (16 * 1024)
+
+// what a completion is for, in the low bits of its user_data
+#define OP_ACCEPT 0  // the multishot accept, user_data is just this
+#define OP_IO 1      // the operation in flight for a connection
+#define OP_CONNECT 2 // the connect linked in front of sending the request
+#define OP_MASK 3
+
+typedef enum {
+    CONN_READ_REQUEST, // accumulating the client's request header
+    CONN_CONNECT,      // connect, linked with sending the request
+    CONN_SEND_REQUEST, // sending what is left of the request
+    CONN_RELAY_HEAD,   // reading the response header, to judge it first
+    CONN_RELAY_RECV,   // waiting for response bytes from the end server
+    CONN_RELAY_SEND,   // passing them on to the client
+    CONN_SERVE_CACHE,  // sending a cached web object to the client
+    CONN_SEND_ERROR,   // sending an error response, then close
+} conn_state_t;
+
+/* result of handling a completion */
+typedef enum {
+    STEP_WAIT,  // the next operation is submitted
+    STEP_CLOSE, // transaction over, tear the connection down
+} step_t;
+
+typedef struct {
+    conn_state_t state;
+    int client_fd;
+    int server_fd;
+    int inflight;        // operations submitted and not completed yet
+    int notifs;          // zero-copy sends the kernel still holds
+    bool closed;         // freed once inflight and notifs are 0
+    int res;             // result of the last OP_IO
+    uint32_t flags;      // and its completion flags
+    bool connect_failed; // the linked connect did not complete
+    dns_result_t addrs;  // end server addresses
+    int next_addr;       // next one to try connecting to
+
+    // request to the end server, pointing into req and buf
+    http_request_t req;
+    struct iovec req_iov[HTTP_REQUEST_IOVS];
+    struct iovec *req_next; // first iovec not fully sent
+    int req_iovcnt;         // iovecs left from req_next
+    // sendmsg in flight, of the request or a cache hit
+    struct msghdr msg;
+    struct iovec obj_iov[CACHE_OBJ_IOVS];
+
+    // error response to the client
+    char *out;
+    size_t out_len;
+    size_t out_off;
+
+    // cache hit being sent to the client
+    cache_obj_t *obj;
+    size_t obj_off;
+    // stale hit being revalidated, served if the end server says 304
+    cache_obj_t *stale;
+
+    // response being relayed, kept for the cache while it still fits
+    char *key;
+    cache_fill_t fill;
+    bool cachable;
+
+    // response bytes being sent on, in buf or in provided buffer bid
+    const char *data;
+    int bid; // -1 for buf
+    size_t len;
+    size_t off;
+    // request header bytes, then the response header
+    char buf[MAXBUF];
+} conn_t;
+
+typedef struct {
+    int id;
+    int fd; // the ring
+    int listenfd;
+    const listeners_t *listeners;
+    bool zc; // zero-copy sendmsg is supported
+
+    // submission queue, shared with the kernel
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail; // next entry to fill, published on io_uring_enter
+    struct io_uring_sqe *sqes;
+
+    // completion queue, shared with the kernel
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // provided buffers, and the ring handing them to the kernel
+    struct io_uring_buf_ring *buf_ring;
+    uint16_t buf_tail;
+    char *buf_mem;
+} loop_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nargs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/*
+ * submit what was queued, and wait for at least wait completions
+ */
+static void ring_enter(loop_t *loop, unsigned wait) {
+    __atomic_store_n(loop->sq_ktail, loop->sq_tail, __ATOMIC_RELEASE);
+    unsigned pending =
+        loop->sq_tail - __atomic_load_n(loop->sq_khead, __ATOMIC_ACQUIRE);
+    int rc = sys_io_uring_enter(loop->fd, pending, wait,
+                                wait ? IORING_ENTER_GETEVENTS : 0);
+    if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+}
+
+/*
+ * make sure n submission entries are free, submitting if not
+ */
+static void ring_reserve(loop_t *loop, unsigned n) {
+    while (loop->sq_tail - __atomic_load_n(loop->sq_khead, __ATOMIC_ACQUIRE) +
+               n >
+           loop->sq_entries) {
+        ring_enter(loop, 0);
+    }
+}
+
+/*
+ * the next free submission entry, cleared
+ */
+static struct io_uring_sqe *ring_sqe(loop_t *loop) {
+    ring_reserve(loop, 1);
+    struct io_uring_sqe *sqe = &loop->sqes[loop->sq_tail & loop->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_tail++;
+    return sqe;
+}
+
+/*
+ * queue an operation of c; its completion runs c's next step
+ */
+static struct io_uring_sqe *conn_sqe(loop_t *loop, conn_t *c, int op,
+                                     int fd, uint64_t kind) {
+    struct io_uring_sqe *sqe = ring_sqe(loop);
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)c | kind;
+    c->inflight++;
+    return sqe;
+}
+
+/*
+ * hand buffer bid back to the kernel
+ */
+static void buf_provide(loop_t *loop, int bid) {
+    struct io_uring_buf *buf =
+        &loop->buf_ring->bufs[loop->buf_tail & (URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->buf_mem +
+                                      (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (uint16_t)bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * give back the provided buffer c is sending from, if any
+ */
+static void conn_release_buf(loop_t *loop, conn_t *c) {
+    if (c->bid >= 0) {
+        buf_provide(loop, c->bid);
+        c->bid = -1;
+    }
+}
+
+/*
+ * receive into the len bytes at buf, or into a provided buffer if buf is
+ * NULL
+ */
+static step_t submit_recv(loop_t *loop, conn_t *c, int fd, char *buf,
+                          size_t len) {
+    struct io_uring_sqe *sqe = conn_sqe(loop, c, IORING_OP_RECV, fd, OP_IO);
+    if (buf) {
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+    } else {
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+    }
+    return STEP_WAIT;
+}
+
+static step_t submit_send(loop_t *loop, conn_t *c, int fd, const char *buf,
+                          size_t len) {
+    struct io_uring_sqe *sqe = conn_sqe(loop, c, IORING_OP_SEND, fd, OP_IO);
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return STEP_WAIT;
+}
+
+/*
+ * send iovcnt iovecs at iov, which must stay put until it completes,
+ * without copying them if zc
+ */
+static step_t submit_sendmsg(loop_t *loop, conn_t *c, int fd,
+                             struct iovec *iov, int iovcnt, bool zc) {
+    struct io_uring_sqe *sqe = conn_sqe(
+        loop, c, zc ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG, fd, OP_IO);
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = iov;
+    c->msg.msg_iovlen = (size_t)iovcnt;
+    sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return STEP_WAIT;
+}
+
+static conn_t *conn_new(int fd) {
+    conn_t *c = malloc(sizeof(conn_t));
+    if (!c) {
+        return NULL;
+    }
+    c->state = CONN_READ_REQUEST;
+    c->client_fd = fd;
+    c->server_fd = -1;
+    c->inflight = 0;
+    c->notifs = 0;
+    c->closed = false;
+    c->addrs.naddrs = 0;
+    c->next_addr = 0;
+    c->req_next = c->req_iov;
+    c->req_iovcnt = 0;
+    c->out = NULL;
+    c->obj = NULL;
+    c->obj_off = 0;
+    c->stale = NULL;
+    c->key = NULL;
+    cache_fill_init(&c->fill);
+    c->cachable = false;
+    c->data = c->buf;
+    c->bid = -1;
+    c->len = 0;
+    c->off = 0;
+    return c;
+}
+
+/*
+ * close both sockets and release what the transaction held; the conn
+ * itself, and a cache hit still being sent from, go once the kernel is
+ * done with them
+ */
+static void conn_close(loop_t *loop, conn_t *c) {
+    c->closed = true;
+    close(c->client_fd);
+    if (c->server_fd >= 0) {
+        close(c->server_fd);
+    }
+    conn_release_buf(loop, c);
+    free_cache_obj(c->stale);
+    free(c->out);
+    free(c->key);
+    cache_fill_discard(&c->fill);
+}
+
+static void conn_free(conn_t *c) {
+    free_cache_obj(c->obj);
+    free(c);
+}
+
+static step_t send_error(loop_t *loop, conn_t *c) {
+    c->state = CONN_SEND_ERROR;
+    return submit_send(loop, c, c->client_fd, c->out + c->out_off,
+                       c->out_len - c->out_off);
+}
+
+static step_t conn_error(loop_t *loop, conn_t *c, const char *errnum,
+                         const char *shortmsg, const char *longmsg) {
+    c->out = malloc(MAXLINE + MAXBUF);
+    if (!c->out) {
+        return STEP_CLOSE;
+    }
+    c->out_len = http_format_error(c->out, MAXLINE + MAXBUF, errnum,
+                                   shortmsg, longmsg);
+    c->out_off = 0;
+    if (c->out_len == 0) {
+        return STEP_CLOSE;
+    }
+    return send_error(loop, c);
+}
+
+static step_t read_request(loop_t *loop, conn_t *c) {
+    c->state = CONN_READ_REQUEST;
+    return submit_recv(loop, c, c->client_fd, c->buf + c->len,
+                       sizeof(c->buf) - 1 - c->len);
+}
+
+/*
+ * send what is left of c->obj, from a zero-copy send if it is large
+ */
+static step_t serve_obj(loop_t *loop, conn_t *c) {
+    if (c->obj_off >= c->obj->size) {
+        return STEP_CLOSE;
+    }
+    int iovcnt = cache_obj_iov(c->obj, c->obj_off, c->obj_iov, CACHE_OBJ_IOVS);
+    c->state = CONN_SERVE_CACHE;
+    return submit_sendmsg(loop, c, c->client_fd, c->obj_iov, iovcnt,
+                          loop->zc &&
+                              c->obj->size - c->obj_off >= URING_ZC_MIN);
+}
+
+/*
+ * connect to the next address of the end server, with the request
+ * linked behind
+ */
+static step_t connect_next(loop_t *loop, conn_t *c) {
+    while (c->next_addr < c->addrs.naddrs) {
+        dns_addr_t *p = &c->addrs.addrs[c->next_addr++];
+        int fd = socket(p->family, p->socktype, p->protocol);
+        if (fd < 0) {
+            continue;
+        }
+        c->server_fd = fd;
+        c->connect_failed = false;
+        c->state = CONN_CONNECT;
+
+        // both in one submission, the link does not span two
+        ring_reserve(loop, 2);
+        struct io_uring_sqe *sqe =
+            conn_sqe(loop, c, IORING_OP_CONNECT, fd, OP_CONNECT);
+        sqe->addr = (uint64_t)(uintptr_t)&p->addr;
+        sqe->off = p->addrlen;
+        sqe->flags = IOSQE_IO_LINK;
+        return submit_sendmsg(loop, c, fd, c->req_next, c->req_iovcnt, false);
+    }
+    return STEP_CLOSE;
+}
+
+/*
+ * hand a CONNECT over to a tunnel, with whatever the client sent after
+ * its header, and close this loop's side of it
+ */
+static step_t start_tunnel(loop_t *loop, conn_t *c) {
+    size_t head = http_head_end(c->buf, c->len, &c->off);
+    size_t early = head > 0 ? c->len - head : 0;
+
+    if (dns_resolve(c->req.host, c->req.port, &c->addrs) != 0) {
+        return conn_error(loop, c, "502", "Bad Gateway",
+                          "Proxy could not resolve the end server");
+    }
+    if (!tunnel_open(c->client_fd, &c->addrs, c->buf + head, early)) {
+        return conn_error(loop, c, "503", "Service Unavailable",
+                          "Proxy could not open a tunnel");
+    }
+    return STEP_CLOSE;
+}
+
+/*
+ * parse the buffered request header, then serve it from the cache or
+ * start fetching it from the end server
+ */
+static step_t start_request(loop_t *loop, conn_t *c) {
+    http_request_t *req = &c->req;
+    http_error_t err;
+
+    c->buf[c->len] = '\0';
+    if (!http_request_parse(req, c->buf, c->len, &err)) {
+        return conn_error(loop, c, err.errnum, err.shortmsg, err.longmsg);
+    }
+    if (req->method == HTTP_METHOD_CONNECT) {
+        return start_tunnel(loop, c);
+    }
+
+    // check if the request is cached before calling server
+    cache_obj_t *obj = search_cache_obj(req->uri);
+    bool hit = obj && cache_obj_fresh(obj);
+    if (obj && !hit && refresh_enabled()) {
+        // served stale while a refresher asks the end server
+        refresh_submit(obj);
+        hit = true;
+    }
+    if (hit) {
+        c->obj = obj;
+        c->obj_off = 0;
+        return serve_obj(loop, c);
+    }
+    // stale: ask whether it changed if it can be asked, else refetch it
+    if (obj && (obj->etag || obj->last_modified)) {
+        c->stale = obj;
+        req->if_none_match = obj->etag;
+        req->if_modified_since = obj->last_modified;
+    } else {
+        free_cache_obj(obj);
+    }
+
+    c->key = strdup(req->uri);
+    if (!c->key) {
+        return STEP_CLOSE;
+    }
+    cache_fill_start(&c->fill);
+    // sent straight from buf, which is not reused before that
+    c->req_iovcnt = http_request_iov(req, false, c->req_iov);
+    c->req_next = c->req_iov;
+
+    // name resolution still blocks this loop on a cache miss
+    if (dns_resolve(req->host, req->port, &c->addrs) != 0) {
+        return STEP_CLOSE;
+    }
+    c->next_addr = 0;
+    return connect_next(loop, c);
+}
+
+static step_t on_read_request(loop_t *loop, conn_t *c) {
+    if (c->res < 0) {
+        return STEP_CLOSE;
+    }
+    if (c->res == 0) {
+        // client is done sending, serve whatever lines did arrive
+        if (!memchr(c->buf, '\n', c->len)) {
+            return STEP_CLOSE;
+        }
+        return start_request(loop, c);
+    }
+    c->len += (size_t)c->res;
+    if (http_head_end(c->buf, c->len, &c->off)) {
+        return start_request(loop, c);
+    }
+    if (c->len == sizeof(c->buf) - 1) {
+        return conn_error(loop, c, "400", "Bad Request",
+                          "Proxy could not fit the request headers");
+    }
+    return read_request(loop, c);
+}
+
+static step_t on_send_request(loop_t *loop, conn_t *c) {
+    if (c->res < 0) {
+        return STEP_CLOSE;
+    }
+    c->req_next = http_iov_advance(c->req_next, &c->req_iovcnt, (size_t)c->res);
+    if (c->req_iovcnt > 0) {
+        c->state = CONN_SEND_REQUEST;
+        return submit_sendmsg(loop, c, c->server_fd, c->req_next,
+                              c->req_iovcnt, false);
+    }
+    c->len = 0;
+    c->off = 0;
+    c->cachable = true;
+    c->state = CONN_RELAY_HEAD;
+    return submit_recv(loop, c, c->server_fd, c->buf, sizeof(c->buf) - 1);
+}
+
+static step_t on_connect(loop_t *loop, conn_t *c) {
+    if (c->connect_failed) {
+        close(c->server_fd);
+        c->server_fd = -1;
+        return connect_next(loop, c);
+    }
+    return on_send_request(loop, c);
+}
+
+/*
+ * save the n relayed bytes at data while the response still fits in a
+ * cache object
+ */
+static void conn_fill(conn_t *c, const char *data, size_t n) {
+    if (c->cachable && !cache_fill_append(&c->fill, data, n)) {
+        c->cachable = false;
+    }
+}
+
+/*
+ * send the relayed bytes not sent yet, then wait for more
+ */
+static step_t relay_send(loop_t *loop, conn_t *c) {
+    if (c->off < c->len) {
+        c->state = CONN_RELAY_SEND;
+        return submit_send(loop, c, c->client_fd, c->data + c->off,
+                           c->len - c->off);
+    }
+    conn_release_buf(loop, c);
+    c->state = CONN_RELAY_RECV;
+    return submit_recv(loop, c, c->server_fd, NULL, 0);
+}
+
+/*
+ * the response header is in, or buf is full of it: judge it as the
+ * epoll engine does before relaying anything
+ */
+static step_t on_relay_head(loop_t *loop, conn_t *c) {
+    if (c->res < 0) {
+        return STEP_CLOSE;
+    }
+    c->len += (size_t)c->res;
+    size_t head_len = http_head_end(c->buf, c->len, &c->off);
+    if (!head_len && c->res > 0 && c->len < sizeof(c->buf) - 1) {
+        return submit_recv(loop, c, c->server_fd, c->buf + c->len,
+                           sizeof(c->buf) - 1 - c->len);
+    }
+    c->buf[c->len] = '\0';
+
+    http_response_t resp;
+    bool parsed = head_len && http_response_parse(&resp, c->buf, head_len);
+    long long lifetime = parsed ? http_response_lifetime(&resp, time(NULL)) : 0;
+    if (!parsed || !http_response_cachable(&resp)) {
+        // also a 304 for a stale hit, answered from the cache below
+        c->cachable = false;
+    } else {
+        cache_fill_freshness(&c->fill, lifetime, resp.etag.ptr, resp.etag.len,
+                             resp.last_modified.ptr, resp.last_modified.len);
+    }
+
+    if (parsed && c->stale && resp.status == 304) {
+        cache_obj_refresh(c->stale, lifetime);
+        close(c->server_fd);
+        c->server_fd = -1;
+        c->obj = c->stale;
+        c->obj_off = 0;
+        c->stale = NULL;
+        return serve_obj(loop, c);
+    }
+
+    conn_fill(c, c->buf, c->len);
+    c->data = c->buf;
+    c->off = 0;
+    return relay_send(loop, c);
+}
+
+static step_t on_relay_recv(loop_t *loop, conn_t *c) {
+    if (c->res == -ENOBUFS) {
+        // every provided buffer is on its way to some client
+        return submit_recv(loop, c, c->server_fd, c->buf, sizeof(c->buf));
+    }
+    if (c->res < 0) {
+        return STEP_CLOSE;
+    }
+    if (c->res == 0) {
+        if (c->cachable && c->fill.size > 0) {
+            insert_cache_obj_to_cache(c->key, &c->fill);
+        }
+        return STEP_CLOSE;
+    }
+    if (c->flags & IORING_CQE_F_BUFFER) {
+        c->bid = (int)(c->flags >> IORING_CQE_BUFFER_SHIFT);
+        c->data = loop->buf_mem + (size_t)c->bid * URING_BUF_SIZE;
+    } else {
+        c->data = c->buf;
+    }
+    c->len = (size_t)c->res;
+    c->off = 0;
+    conn_fill(c, c->data, c->len);
+    return relay_send(loop, c);
+}
+
+static step_t on_relay_send(loop_t *loop, conn_t *c) {
+    if (c->res < 0) {
+        return STEP_CLOSE;
+    }
+    c->off += (size_t)c->res;
+    return relay_send(loop, c);
+}
+
+static step_t on_serve_cache(loop_t *loop, conn_t *c) {
+    if (c->res < 0) {
+        return STEP_CLOSE;
+    }
+    c->obj_off += (size_t)c->res;
+    return serve_obj(loop, c);
+}
+
+static step_t on_send_error(loop_t *loop, conn_t *c) {
+    if (c->res < 0) {
+        return STEP_CLOSE;
+    }
+    c->out_off += (size_t)c->res;
+    if (c->out_off < c->out_len) {
+        return send_error(loop, c);
+    }
+    return STEP_CLOSE;
+}
+
+/*
+ * run the step the completed operation of c leads to
+ */
+static step_t conn_step(loop_t *loop, conn_t *c) {
+    switch (c->state) {
+    case CONN_READ_REQUEST:
+        return on_read_request(loop, c);
+    case CONN_CONNECT:
+        return on_connect(loop, c);
+    case CONN_SEND_REQUEST:
+        return on_send_request(loop, c);
+    case CONN_RELAY_HEAD:
+        return on_relay_head(loop, c);
+    case CONN_RELAY_RECV:
+        return on_relay_recv(loop, c);
+    case CONN_RELAY_SEND:
+        return on_relay_send(loop, c);
+    case CONN_SERVE_CACHE:
+        return on_serve_cache(loop, c);
+    case CONN_SEND_ERROR:
+        return on_send_error(loop, c);
+    }
+    return STEP_CLOSE;
+}
+
+static void submit_accept(loop_t *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void loop_accept(loop_t *loop, const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // the kernel stopped accepting, say out of descriptors
+        submit_accept(loop);
+    }
+    if (cqe->res < 0) {
+        return;
+    }
+    conn_t *c = conn_new(cqe->res);
+    if (!c) {
+        close(cqe->res);
+        return;
+    }
+    read_request(loop, c);
+}
+
+static void loop_complete(loop_t *loop, const struct io_uring_cqe *cqe) {
+    if (cqe->user_data == OP_ACCEPT) {
+        loop_accept(loop, cqe);
+        return;
+    }
+
+    conn_t *c = (conn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+        c->notifs--;
+    } else {
+        if (cqe->flags & IORING_CQE_F_MORE) {
+            // a zero-copy send, its notification follows
+            c->notifs++;
+        }
+        c->inflight--;
+        if ((cqe->user_data & OP_MASK) == OP_CONNECT) {
+            c->connect_failed = cqe->res < 0;
+        } else {
+            c->res = cqe->res;
+            c->flags = cqe->flags;
+        }
+        // a failed connect cancels the send linked to it, wait for both
+        if (c->inflight == 0 && !c->closed &&
+            conn_step(loop, c) == STEP_CLOSE) {
+            conn_close(loop, c);
+        }
+    }
+    if (c->closed && c->inflight == 0 && c->notifs == 0) {
+        conn_free(c);
+    }
+}
+
+static void *loop_thread(void *vargp) {
+    loop_t *loop = vargp;
+
+    listeners_pin(loop->listeners, loop->id);
+    while (1) {
+        ring_enter(loop, 1);
+        unsigned head = *loop->cq_khead;
+        while (head != __atomic_load_n(loop->cq_ktail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = loop->cqes[head & loop->cq_mask];
+            // free the entry at once, the kernel may have more to post
+            __atomic_store_n(loop->cq_khead, ++head, __ATOMIC_RELEASE);
+            loop_complete(loop, &cqe);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * whether the ring at fd supports opcode op
+ */
+static bool ring_supports(int fd, int op) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = probe &&
+                     sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+                                           256) == 0 &&
+                     op <= probe->last_op &&
+                     (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+/*
+ * register the loop's provided buffers and hand all of them out
+ * return false if the kernel has no provided buffer rings
+ */
+static bool buffers_init(loop_t *loop) {
+    size_t ring_size = URING_BUFS * sizeof(struct io_uring_buf);
+    loop->buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buf_ring == MAP_FAILED) {
+        return false;
+    }
+    loop->buf_mem = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (!loop->buf_mem) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(loop->fd, IORING_REGISTER_PBUF_RING, &reg, 1) <
+        0) {
+        return false;
+    }
+    loop->buf_tail = 0;
+    for (int i = 0; i < URING_BUFS; i++) {
+        buf_provide(loop, i);
+    }
+    return true;
+}
+
+/*
+ * set up the loop's ring and map its queues
+ * return false if the kernel lacks anything the engine needs
+ */
+static bool ring_init(loop_t *loop) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    loop->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (loop->fd < 0) {
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        return false;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = mmap(NULL, sq_size > cq_size ? sq_size : cq_size,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       loop->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        return false;
+    }
+    loop->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->fd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        return false;
+    }
+
+    loop->sq_khead = (unsigned *)(rings + p.sq_off.head);
+    loop->sq_ktail = (unsigned *)(rings + p.sq_off.tail);
+    loop->sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+    loop->sq_entries = p.sq_entries;
+    loop->sq_tail = *loop->sq_ktail;
+    // entry i of the queue is always submission i
+    unsigned *array = (unsigned *)(rings + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    loop->cq_khead = (unsigned *)(rings + p.cq_off.head);
+    loop->cq_ktail = (unsigned *)(rings + p.cq_off.tail);
+    loop->cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+    loop->zc = ring_supports(loop->fd, IORING_OP_SENDMSG_ZC);
+    return buffers_init(loop);
+}
+
+bool uring_run(const listeners_t *listeners, int nthreads) {
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    loop_t *loops = calloc((size_t)nthreads, sizeof(loop_t));
+    if (!loops) {
+        return false;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        loops[i].id = i;
+        loops[i].listenfd = listeners_fd(listeners, i);
+        loops[i].listeners = listeners;
+        if (!ring_init(&loops[i])) {
+            // nothing was submitted yet, closing the rings is all it takes
+            for (int j = 0; j <= i; j++) {
+                if (loops[j].fd >= 0) {
+                    close(loops[j].fd);
+                }
+            }
+            free(loops);
+            return false;
+        }
+        submit_accept(&loops[i]);
+    }
+
+    for (int i = 1; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, loop_thread, &loops[i]) != 0) {
+            fprintf(stderr, "could not start io_uring loop %d\n", i);
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    loop_thread(&loops[0]);
+    return true;
+}
+
+#else
+
+bool uring_run(const listeners_t *listeners, int nthreads) {
+    (void)listeners;
+    (void)nthreads;
+    return false;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef URING_H
+#define URING_H
+
+#include "listener.h"
+
+#include <stdbool.h>
+
+/*
+ * run the io_uring engine on already listening sockets
+ * nthreads loops accept from theirs, each with a ring of its own
+ * return false, before serving anything, if the kernel lacks what it
+ * needs so the caller can fall back to event_run; else does not return
+ */
+bool uring_run(const listeners_t *listeners, int nthreads);
+
+#endif